@@ -342,7 +342,7 @@ LJLIB_CF(error)
     lua_pushvalue(L, 1);
     lua_concat(L, 2);
   }
-  return lua_error(L);
+  return lj_err_runc(L);
 }
 
 LJLIB_ASM(pcall)		LJLIB_REC(.)
@@ -588,6 +588,22 @@ LJLIB_CF(coroutine_create)
   return 1;
 }
 
+LJLIB_CF(coroutine_recycle)
+{
+  lua_State *co;
+  if (!(L->top > L->base && tvisthread(L->base)))
+    lj_err_arg(L, 1, LJ_ERR_NOCORO);
+  co = threadV(L->base);
+  lj_lib_checkfunc(L, 2);
+  if (co->cframe != NULL || co == mainthread(G(L)))
+    lj_err_caller(L, LJ_ERR_CORECY);
+  lj_state_recycle(L, co);
+  setgcrefr(co->env, L->env);
+  setfuncV(L, co->top++, funcV(L->base+1));
+  L->top = L->base+1;
+  return 1;
+}
+
 LJLIB_ASM(coroutine_yield)
 {
   lj_err_caller(L, LJ_ERR_CYIELD);
@@ -417,7 +417,8 @@ LJLIB_CF(ffi_clib___gc)
 {
   TValue *o = L->base;
   if (o < L->top && tvisudata(o) && udataV(o)->udtype == UDTYPE_FFI_CLIB)
-    lj_clib_unload((CLibrary *)uddata(udataV(o)));
+    lj_clib_unload(L, tabref(udataV(o)->metatable),
+		   (CLibrary *)uddata(udataV(o)));
   return 0;
 }
 
@@ -794,6 +795,16 @@ LJLIB_CF(ffi_load)
   return 1;
 }
 
+LJLIB_CF(ffi_prebind)
+{
+  TValue *o = L->base;
+  if (!(o < L->top && tvisudata(o) && udataV(o)->udtype == UDTYPE_FFI_CLIB))
+    lj_err_argt(L, 1, LUA_TUSERDATA);
+  setintV(L->top++, (int32_t)lj_clib_prebind(L, (CLibrary *)uddata(udataV(o))));
+  lj_gc_check(L);
+  return 1;
+}
+
 LJLIB_PUSH(top-4) LJLIB_SET(C)
 LJLIB_PUSH(top-3) LJLIB_SET(os)
 LJLIB_PUSH(top-2) LJLIB_SET(arch)
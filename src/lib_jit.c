@@ -28,6 +28,7 @@
 #include "lj_vm.h"
 #include "lj_vmevent.h"
 #include "lj_lib.h"
+#include "lj_bcdump.h"
 
 #include "luajit.h"
 
@@ -243,6 +244,8 @@ LJLIB_CF(jit_util_funck)
   } else {
     if (~idx < (ptrdiff_t)pt->sizekgc) {
       GCobj *gc = proto_kgc(pt, idx);
+      if (gc->gch.gct == ~LJ_TPROTO && bclazy_isstub(gco2pt(gc)))
+	gc = obj2gco(lj_bcread_lazy(L, pt, gco2pt(gc)));
       setgcV(L, L->top-1, gc, ~gc->gch.gct);
       return 1;
     }
@@ -279,7 +282,7 @@ static GCtrace *jit_checktrace(lua_State *L)
 /* Names of link types. ORDER LJ_TRLINK */
 static const char *const jit_trlinkname[] = {
   "none", "root", "loop", "tail-recursion", "up-recursion", "down-recursion",
-  "interpreter", "return"
+  "interpreter", "return", "stitch"
 };
 
 /* local info = jit.util.traceinfo(tr) */
@@ -294,6 +297,7 @@ LJLIB_CF(jit_util_traceinfo)
     setintfield(L, t, "nk", REF_BIAS - (int32_t)T->nk);
     setintfield(L, t, "link", T->link);
     setintfield(L, t, "nexit", T->nsnap);
+    setintfield(L, t, "exits", (int32_t)(T->exits & 0x7fffffff));
     setstrV(L, L->top++, lj_str_newz(L, jit_trlinkname[T->linktype]));
     lua_setfield(L, -2, "linktype");
     /* There are many more fields. Add them only when needed. */
@@ -401,6 +405,12 @@ LJLIB_CF(jit_util_traceexitstub)
   return 0;
 }
 
+/* local stats = jit.util.stats([reset]) */
+LJLIB_CF(jit_util_stats)
+{
+  return luaJIT_getstats(L, L->base < L->top && tvistruecond(L->base));
+}
+
 /* local addr = jit.util.ircalladdr(idx) */
 LJLIB_CF(jit_util_ircalladdr)
 {
@@ -26,6 +26,7 @@
 #include "lj_trace.h"
 #include "lj_snap.h"
 #include "lj_asm.h"
+#include "lj_perf.h"
 #include "lj_dispatch.h"
 #include "lj_vm.h"
 #include "lj_target.h"
@@ -386,11 +387,50 @@ static Reg ra_releasetmp(ASMState *as, IRRef ref)
   return r;
 }
 
+#if LJ_TARGET_X86ORX64
+/* Check whether an operand is live in its register at this point. */
+#define ra_islive(as, ref) \
+  (ra_hasreg(IR((ref))->r) && !rset_test(as->freeset, IR((ref))->r) && \
+   regcost_ref(as->cost[IR((ref))->r]) == (ref))
+
+/* Check for a cheap address computation which can be rematerialized. */
+#define ra_canrematref(as, ir) \
+  (((ir)->o == IR_HREFK || ((ir)->o == IR_AREF && irref_isk((ir)->op2))) && \
+   ra_islive(as, (ir)->op1))
+
+/* Rematerialize an address from its base register instead of spilling it.
+** This is a single LEA, which is cheaper than a spill and reload. It also
+** avoids spill stores inside loops.
+*/
+static Reg ra_rematref(ASMState *as, IRRef ref)
+{
+  IRIns *ir = IR(ref);
+  Reg r = ir->r, base = IR(ir->op1)->r;
+  int32_t ofs = ir->o == IR_HREFK ?
+		(int32_t)(IR(ir->op2)->op2 * sizeof(Node)) : 8*IR(ir->op2)->i;
+  lua_assert(ra_hasreg(r) && r != base);
+  ra_free(as, r);
+  ra_modified(as, r);
+  ra_noweak(as, base);
+  ra_sethint(ir->r, r);  /* Keep hint. */
+  RA_DBGX((as, "remat     $i $r", ir, r));
+  if (ofs)
+    emit_rmro(as, XO_LEA, r, base, ofs);
+  else
+    emit_rr(as, XO_MOV, r, base);
+  return r;
+}
+#endif
+
 /* Restore a register (marked as free). Rematerialize or force a spill. */
 static Reg ra_restore(ASMState *as, IRRef ref)
 {
   if (emit_canremat(ref)) {
     return ra_rematk(as, ref);
+#if LJ_TARGET_X86ORX64
+  } else if (ra_canrematref(as, IR(ref))) {
+    return ra_rematref(as, ref);
+#endif
   } else {
     IRIns *ir = IR(ref);
     int32_t ofs = ra_spill(as, ir);  /* Force a spill slot. */
@@ -438,6 +478,22 @@ static Reg ra_evict(ASMState *as, RegSet allow)
     if (!rset_test(as->weakset, ir->r))
       ref = regcost_ref(as->cost[rset_pickbot((as->weakset & allow))]);
   }
+#if LJ_TARGET_X86ORX64
+  /* Otherwise prefer an address which is cheap to rematerialize. */
+  if (!irref_isk(ref) && !ra_canrematref(as, IR(ref))) {
+    RegSet work = allow & ~as->freeset & RSET_GPR;
+    while (work) {
+      Reg r = rset_pickbot(work);
+      IRRef rref = regcost_ref(as->cost[r]);
+      if (!ra_iskref(rref) && !irref_isk(rref) &&
+	  ra_canrematref(as, IR(rref))) {
+	ref = rref;
+	break;
+      }
+      rset_clear(work, r);
+    }
+  }
+#endif
   return ra_restore(as, ref);
 }
 
@@ -702,8 +758,18 @@ static void ra_left(ASMState *as, Reg dest, IRRef lref)
 	return;
       }
     }
-    if (!ra_hashint(left) && !iscrossref(as, lref))
+    if (iscrossref(as, lref)) {
+      /* An invariant in a modified register would need a reload at the
+      ** start of each loop iteration. Load it right here instead.
+      */
+      if (!irt_isphi(ir->t) && !(as->freeset & ~as->modset &
+				 (dest < RID_MAX_GPR ? RSET_GPR : RSET_FPR))) {
+	emit_spload(as, ir, dest, ra_spill(as, ir));
+	return;
+      }
+    } else if (!ra_hashint(left)) {
       ra_sethint(ir->r, dest);  /* Propagate register hint. */
+    }
     left = ra_allocref(as, lref, dest < RID_MAX_GPR ? RSET_GPR : RSET_FPR);
   }
   ra_noweak(as, left);
@@ -1302,6 +1368,9 @@ static void asm_phi(ASMState *as, IRIns *ir)
 }
 
 static void asm_loop_fixup(ASMState *as);
+#if LJ_TARGET_X64
+static void asm_loop_vec(ASMState *as);
+#endif
 
 /* Middle part of a loop. */
 static void asm_loop(ASMState *as)
@@ -1324,6 +1393,18 @@ static void asm_loop(ASMState *as)
   if (!as->realign) RA_DBG_FLUSH();
   if (as->mcp != mcspill)
     emit_jmp(as, mcspill);
+#if LJ_TARGET_X64
+  asm_loop_vec(as);
+#endif
+}
+
+/* Get the BASE adjustment of RETF. Vararg frames hold it in the link. */
+static int32_t asm_retf_delta(ASMState *as, IRIns *ir)
+{
+  intptr_t link = (intptr_t)ir_kptr(IR(ir->op2));
+  if ((link & FRAME_TYPEP) == FRAME_VARG)
+    return (int32_t)(link >> 3);
+  return 1+bc_a(*((const BCIns *)link - 1));
 }
 
 /* -- Target-specific assembler ------------------------------------------- */
@@ -1828,6 +1909,10 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
   ASMState as_;
   ASMState *as = &as_;
   MCode *origtop;
+#ifdef LUAJIT_USE_PERFTOOLS
+  MCode **perfmc = lj_perf_snapmc(J, T->nsnap);
+  SnapNo perfsn = 0;
+#endif
 
   /* Ensure an initialized instruction beyond the last one for HIOP checks. */
   J->cur.nins = lj_ir_nextins(J);
@@ -1871,8 +1956,17 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
       asm_tail_link(as);
 
     /* Assemble a trace in linear backwards order. */
+#ifdef LUAJIT_USE_PERFTOOLS
+    perfsn = T->nsnap;
+#endif
     for (as->curins--; as->curins > as->stopins; as->curins--) {
       IRIns *ir = IR(as->curins);
+#ifdef LUAJIT_USE_PERFTOOLS
+      /* Note where the code for each snapshot starts, for line info. */
+      if (perfmc)
+	while (perfsn > 0 && as->curins < T->snap[perfsn-1].ref)
+	  perfmc[--perfsn] = as->mcp;
+#endif
       lua_assert(!(LJ_32 && irt_isint64(ir->t)));  /* Handled by SPLIT. */
       if (!ra_used(ir) && !ir_sideeff(ir) && (as->flags & JIT_F_OPT_DCE))
 	continue;  /* Dead-code elimination can be soooo easy. */
@@ -1906,6 +2000,11 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
 
   /* Set trace entry point before fixing up tail to allow link to self. */
   T->mcode = as->mcp;
+#ifdef LUAJIT_USE_PERFTOOLS
+  if (perfmc)
+    while (perfsn > 0)
+      perfmc[--perfsn] = as->mcp;
+#endif
   T->mcloop = as->mcloop ? (MSize)((char *)as->mcloop - (char *)as->mcp) : 0;
   if (!as->loopref)
     asm_tail_fixup(as, T->link);  /* Note: this may change as->mctop! */
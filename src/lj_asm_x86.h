@@ -364,6 +364,12 @@ static Reg asm_fuseload(ASMState *as, IRRef ref, RegSet allow)
   if (!(as->freeset & allow) &&
       (allow == RSET_EMPTY || ra_hasspill(ir->s) || iscrossref(as, ref)))
     goto fusespill;
+  /* An invariant in a modified register has to be reloaded at the start
+  ** of each loop iteration. Better use the spill slot right here.
+  */
+  if (iscrossref(as, ref) && !irt_isphi(ir->t) &&
+      !(as->freeset & ~as->modset & allow))
+    goto fusespill;
   return ra_allocref(as, ref, allow);
 }
 
@@ -644,7 +650,7 @@ static void asm_retf(ASMState *as, IRIns *ir)
 {
   Reg base = ra_alloc1(as, REF_BASE, RSET_GPR);
   void *pc = ir_kptr(IR(ir->op2));
-  int32_t delta = 1+bc_a(*((const BCIns *)pc - 1));
+  int32_t delta = asm_retf_delta(as, ir);
   as->topslot -= (BCReg)delta;
   if ((int32_t)as->topslot < 0) as->topslot = 0;
   irt_setmark(IR(REF_BASE)->t);  /* Children must not coalesce with BASE reg. */
@@ -2426,6 +2432,274 @@ static void asm_gc_check(ASMState *as)
   checkmclim(as);
 }
 
+/* -- Loop vectorization -------------------------------------------------- */
+
+#if LJ_64
+/* Simple loops over double arrays are vectorized with packed SSE2 ops.
+** The vector loop is placed between the pre-roll and the scalar loop and
+** handles two iterations at a time. It falls through to the scalar loop,
+** which handles the remaining iterations and all exits. The body of the
+** loop must be straight-line code made up of XLOAD/XSTORE of doubles,
+** indexed by the loop variable, and elementwise FP arithmetic. Overlapping
+** arrays are detected at runtime, which skips the vector loop.
+*/
+
+#define VEC_MAXINS	64	/* Max. number of instructions in loop body. */
+#define VEC_MAXMEM	6	/* Max. number of memory references. */
+#define VEC_MAXFPR	14	/* Max. number of FP registers used. */
+
+typedef struct VecMem {
+  IRRef1 base;		/* Loop-invariant base pointer. */
+  uint8_t store;	/* Store or load. */
+  Reg rb;		/* Register for base pointer. */
+  int32_t ofs;		/* Constant offset. */
+} VecMem;
+
+/* Check for idx*8. */
+static int asm_vec_isidx(ASMState *as, IRRef ref, IRRef idx)
+{
+  IRIns *ir = IR(ref);
+  return (ir->o == IR_BSHL && ir->op1 == idx &&
+	  irref_isk(ir->op2) && IR(ir->op2)->i == 3);
+}
+
+/* Split address into base + idx*8 + ofs. */
+static int asm_vec_addr(ASMState *as, IRRef ref, IRRef idx, VecMem *m)
+{
+  IRIns *ir = IR(ref);
+  int64_t ofs = 0;
+  if (ir->o == IR_ADD && irref_isk(ir->op2)) {
+    IRIns *irk = IR(ir->op2);
+    ofs = irk->o == IR_KINT64 ? (int64_t)ir_kint64(irk)->u64 : irk->i;
+    ir = IR(ir->op1);
+  }
+  if (ir->o == IR_ADD && irt_is64(ir->t) && ofs == (int32_t)ofs) {
+    IRRef base = ir->op2;
+    if (asm_vec_isidx(as, ir->op2, idx))
+      base = ir->op1;
+    else if (!asm_vec_isidx(as, ir->op1, idx))
+      return 0;
+    if (base < as->loopref && !irref_isk(base)) {
+      m->base = (IRRef1)base;
+      m->ofs = (int32_t)ofs;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Check FP operand of vectorized instruction. */
+static int asm_vec_operand(ASMState *as, IRRef ref, uint8_t *vreg,
+			   uint8_t *nuse, IRRef *inv, int *ninv)
+{
+  int i;
+  if (ref > as->loopref) {
+    nuse[ref - as->loopref]++;
+    return vreg[ref - as->loopref] != RID_NONE;
+  }
+  if (!irt_isnum(IR(ref)->t))
+    return 0;
+  for (i = 0; i < *ninv; i++)
+    if (inv[i] == ref) return 1;
+  if (*ninv >= VEC_MAXFPR/2)
+    return 0;
+  inv[(*ninv)++] = ref;
+  return 1;
+}
+
+/* Register holding a vectorized operand. */
+static Reg asm_vec_reg(ASMState *as, IRRef ref, uint8_t *vreg, IRRef *inv,
+		       Reg *rinv)
+{
+  int i;
+  if (ref > as->loopref)
+    return vreg[ref - as->loopref];
+  for (i = 0; inv[i] != ref; i++) ;
+  return rinv[i];
+}
+
+/* Emit vector loop in front of the scalar loop. */
+static void asm_loop_vec(ASMState *as)
+{
+  IRRef loopref = as->loopref, nins = as->orignins, ref;
+  IRRef idx, next, stop = 0, inv[VEC_MAXFPR/2];
+  IRIns *irphi = IR(nins-1);
+  uint8_t vreg[VEC_MAXINS], nuse[VEC_MAXINS];
+  VecMem mem[VEC_MAXMEM];
+  Reg rinv[VEC_MAXFPR/2], rsrc[VEC_MAXFPR/2], ridx, rstop = RID_NONE, tmp;
+  RegSet allow = RSET_GPR, fallow = RSET_FPR;
+  int nmem = 0, ninv = 0, nval = 0, i, j;
+  MCode *skip, *loop, *p;
+  if (!(as->flags & JIT_F_OPT_VEC) || !(as->flags & JIT_F_SSE2) ||
+      nins - loopref > VEC_MAXINS)
+    return;
+  /* A single integer PHI for the loop variable, incremented by one. */
+  if (irphi->o != IR_PHI || irphi[-1].o == IR_PHI || !irt_isint(irphi->t) ||
+      ra_noreg(irphi->r) || ra_hasspill(irphi->s))
+    return;
+  idx = irphi->op1; next = irphi->op2;
+  if (IR(next)->o != IR_ADD || IR(next)->op1 != idx ||
+      !irref_isk(IR(next)->op2) || IR(IR(next)->op2)->i != 1)
+    return;
+  /* Check the loop body. */
+  for (ref = loopref+1; ref < nins-1; ref++) {
+    IRIns *ir = IR(ref);
+    vreg[ref - loopref] = RID_NONE;
+    nuse[ref - loopref] = 0;
+    if (irt_isguard(ir->t)) {
+      /* The only guard must be the loop condition, checked last. */
+      if (ir->o != IR_LE || ir->op1 != next || ir->op2 >= loopref ||
+	  ref != nins-2 || stop)
+	return;
+      stop = ir->op2;
+      continue;
+    }
+    switch (ir->o) {
+    case IR_NOP:
+      break;
+    case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+      if (irt_isnum(ir->t)) {
+	if (!asm_vec_operand(as, ir->op1, vreg, nuse, inv, &ninv) ||
+	    !asm_vec_operand(as, ir->op2, vreg, nuse, inv, &ninv))
+	  return;
+	vreg[ref - loopref] = 0;
+	nval++;
+      } else if (!(ref == next || (ir->o == IR_ADD && irt_is64(ir->t)))) {
+	return;  /* Address arithmetic is checked below. */
+      }
+      break;
+    case IR_BSHL:
+      if (!asm_vec_isidx(as, ref, idx)) return;
+      break;
+    case IR_XLOAD: case IR_XSTORE:
+      if (nmem >= VEC_MAXMEM || !asm_vec_addr(as, ir->op1, idx, &mem[nmem]))
+	return;
+      if (ir->o == IR_XLOAD) {
+	if (!irt_isnum(ir->t) || (ir->op2 & IRXLOAD_VOLATILE))
+	  return;
+	vreg[ref - loopref] = 0;
+	nval++;
+      } else if (!irt_isnum(IR(ir->op2)->t) ||
+		 !asm_vec_operand(as, ir->op2, vreg, nuse, inv, &ninv)) {
+	return;
+      }
+      mem[nmem++].store = (ir->o == IR_XSTORE);
+      break;
+    default:
+      return;
+    }
+  }
+  if (!stop || nmem == 0 || 2*ninv + nval > VEC_MAXFPR)
+    return;
+  /* Overlapping accesses with the same base are resolved statically. */
+  for (i = 0; i < nmem; i++)
+    for (j = i+1; j < nmem; j++)
+      if ((mem[i].store || mem[j].store) && mem[i].base == mem[j].base &&
+	  (uint32_t)(mem[i].ofs - mem[j].ofs + 15) <= 30 &&
+	  mem[i].ofs != mem[j].ofs)
+	return;
+
+  /* Allocate all registers upfront. Nothing must move inside the loop. */
+  ridx = ra_alloc1(as, idx, allow);
+  rset_clear(allow, ridx);
+  if (!irref_isk(stop)) {
+    rstop = ra_alloc1(as, stop, allow);
+    rset_clear(allow, rstop);
+  }
+  for (i = 0; i < nmem; i++) {
+    mem[i].rb = ra_alloc1(as, mem[i].base, allow);
+    rset_clear(allow, mem[i].rb);
+  }
+  for (i = 0; i < ninv; i++) {
+    if (!irref_isk(inv[i])) {
+      rsrc[i] = ra_alloc1(as, inv[i], fallow);
+      rset_clear(fallow, rsrc[i]);
+    }
+  }
+  tmp = ra_scratch(as, allow);
+  for (i = 0; i < ninv; i++) {
+    rinv[i] = ra_scratch(as, fallow);
+    rset_clear(fallow, rinv[i]);
+  }
+  for (ref = loopref+1; ref < nins-1; ref++)
+    if (vreg[ref - loopref] != RID_NONE) {
+      IRIns *ir = IR(ref);
+      IRRef left = ir->op1;
+      if (ir->o != IR_XLOAD && left > loopref && nuse[left - loopref] == 1) {
+	vreg[ref - loopref] = vreg[left - loopref];  /* Reuse register. */
+      } else {
+	Reg r = ra_scratch(as, fallow);
+	rset_clear(fallow, r);
+	vreg[ref - loopref] = (uint8_t)r;
+      }
+    }
+
+  /* Vector loop. Runs while at least one more iteration is left over. */
+  checkmclim(as);
+  skip = emit_label(as);
+  emit_jcc(as, CC_AE, as->mcp);
+  p = as->mcp + 6;
+  emit_gri(as, XG_ARITHi(XOg_CMP), tmp, 2);
+  emit_gri(as, XG_ARITHi(XOg_SUB), tmp, 2);
+  emit_gri(as, XG_ARITHi(XOg_ADD), ridx, 2);
+  for (ref = nins-2, j = nmem; ref > loopref; ref--) {
+    IRIns *ir = IR(ref);
+    checkmclim(as);
+    if (ir->o == IR_XLOAD || ir->o == IR_XSTORE) {
+      VecMem *m = &mem[--j];
+      if (ir->o == IR_XLOAD)
+	emit_rmrxo(as, XO_MOVUPD, vreg[ref - loopref], m->rb, ridx,
+		   XM_SCALE8, m->ofs);
+      else
+	emit_rmrxo(as, XO_MOVUPDto,
+		   asm_vec_reg(as, ir->op2, vreg, inv, rinv), m->rb,
+		   ridx, XM_SCALE8, m->ofs);
+    } else if (vreg[ref - loopref] != RID_NONE) {
+      Reg dest = vreg[ref - loopref];
+      Reg left = asm_vec_reg(as, ir->op1, vreg, inv, rinv);
+      Reg right = asm_vec_reg(as, ir->op2, vreg, inv, rinv);
+      x86Op xo = ir->o == IR_ADD ? XO_ADDPD : ir->o == IR_SUB ? XO_SUBPD :
+		 ir->o == IR_MUL ? XO_MULPD : XO_DIVPD;
+      emit_rr(as, xo, dest, right);
+      if (dest != left)
+	emit_rr(as, XO_MOVAPS, dest, left);
+    }
+  }
+  loop = emit_label(as);
+  *(int32_t *)(p-4) = jmprel(p, loop);
+  emit_jcc(as, CC_B, skip);
+  emit_gri(as, XG_ARITHi(XOg_CMP), tmp, 2);
+  /* Number of iterations left over after the current one. */
+  emit_rr(as, XO_ARITH(XOg_SUB), tmp, ridx);
+  if (ra_hasreg(rstop))
+    emit_rr(as, XO_MOV, tmp, rstop);
+  else
+    emit_loadi(as, tmp, IR(stop)->i);
+  /* Broadcast loop-invariant operands. */
+  for (i = 0; i < ninv; i++) {
+    checkmclim(as);
+    emit_rr(as, XO_UNPCKLPD, rinv[i], rinv[i]);
+    if (irref_isk(inv[i]))
+      emit_loadn(as, rinv[i], ir_knum(IR(inv[i])));
+    else
+      emit_rr(as, XO_MOVAPS, rinv[i], rsrc[i]);
+  }
+  /* Check for overlapping arrays. */
+  for (i = 0; i < nmem; i++)
+    for (j = i+1; j < nmem; j++)
+      if ((mem[i].store || mem[j].store) && mem[i].base != mem[j].base) {
+	checkmclim(as);
+	emit_jcc(as, CC_BE, skip);
+	emit_gri(as, XG_ARITHi(XOg_CMP), tmp|REX_64, 30);
+	emit_gri(as, XG_ARITHi(XOg_ADD), tmp|REX_64,
+		 mem[i].ofs - mem[j].ofs + 15);
+	emit_rr(as, XO_ARITH(XOg_SUB), tmp|REX_64, mem[j].rb);
+	emit_rr(as, XO_MOV, tmp|REX_64, mem[i].rb);
+      }
+  checkmclim(as);
+}
+#endif
+
 /* -- Loop handling ------------------------------------------------------- */
 
 /* Fixup the loop branch. */
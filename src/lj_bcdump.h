@@ -45,6 +45,9 @@
 
 #define BCDUMP_F_KNOWN		(BCDUMP_F_FFI*2-1)
 
+/* Internal flag, never written: the dump is referenced in place. */
+#define BCDUMP_F_MAPPED		0x80
+
 /* Type codes for the GC constants of a prototype. Plus length for strings. */
 enum {
   BCDUMP_KGC_CHILD, BCDUMP_KGC_TAB, BCDUMP_KGC_I64, BCDUMP_KGC_U64,
@@ -57,10 +60,25 @@ enum {
   BCDUMP_KTAB_INT, BCDUMP_KTAB_NUM, BCDUMP_KTAB_STR
 };
 
+/* -- Lazily loaded prototypes -------------------------------------------- */
+
+/*
+** With LUAJIT_MODE_LAZYLOAD, the bytecode reader only loads the main chunk.
+** All other prototypes are replaced with stubs (sizebc == 0), which are
+** loaded on demand, i.e. on first closure creation. The GC constants of a
+** stub hold its child stubs, followed by the string holding a copy of the
+** dump. There's no copy if the dump is mapped (luaJIT_loadmapped).
+*/
+#define bclazy_isstub(pt)	((pt)->sizebc == 0)
+#define bclazy_rec(pt)		mref((pt)->lineinfo, const char)  /* Record. */
+#define bclazy_len(pt)		((pt)->sizekn)	/* Length of record. */
+#define bclazy_flags(pt)	((pt)->framesize)  /* Dump flags. */
+
 /* -- Bytecode reader/writer ---------------------------------------------- */
 
 LJ_FUNC int lj_bcwrite(lua_State *L, GCproto *pt, lua_Writer writer,
 		       void *data, int strip);
 LJ_FUNC GCproto *lj_bcread(LexState *ls);
+LJ_FUNC GCproto *lj_bcread_lazy(lua_State *L, GCproto *parent, GCproto *pt);
 
 #endif
@@ -334,6 +334,7 @@ static GCproto *bcread_proto(LexState *ls)
   MSize sizedbg = 0;
   BCLine firstline = 0, numline = 0;
   MSize len, startn;
+  const char *dbg = NULL;
 
   /* Read length. */
   if (ls->n > 0 && ls->p[0] == 0) {  /* Shortcut EOF. */
@@ -345,6 +346,7 @@ static GCproto *bcread_proto(LexState *ls)
   if (!len) return NULL;  /* EOF */
   bcread_need(ls, len);
   startn = ls->n;
+  dbg = ls->p + len;
 
   /* Read prototype header. */
   flags = bcread_byte(ls);
@@ -362,6 +364,13 @@ static GCproto *bcread_proto(LexState *ls)
     }
   }
 
+  /* Debug info of a mapped dump may be referenced in place. */
+  dbg -= sizedbg;
+  if (!sizedbg || !(bcread_flags(ls) & BCDUMP_F_MAPPED) || bcread_swap(ls) ||
+      (!LJ_TARGET_UNALIGNED &&
+       ((uintptr_t)dbg & (numline < 256 ? 0 : numline < 65536 ? 1 : 3))))
+    dbg = NULL;
+
   /* Calculate total size of prototype including all colocated arrays. */
   sizept = (MSize)sizeof(GCproto) +
 	   sizebc*(MSize)sizeof(BCIns) +
@@ -369,7 +378,7 @@ static GCproto *bcread_proto(LexState *ls)
   sizept = (sizept + (MSize)sizeof(TValue)-1) & ~((MSize)sizeof(TValue)-1);
   ofsk = sizept; sizept += sizekn*(MSize)sizeof(TValue);
   ofsuv = sizept; sizept += ((sizeuv+1)&~1)*2;
-  ofsdbg = sizept; sizept += sizedbg;
+  ofsdbg = sizept; if (!dbg) sizept += sizedbg;
 
   /* Allocate prototype object and initialize its fields. */
   pt = (GCproto *)lj_mem_newgco(ls->L, (MSize)sizept);
@@ -404,9 +413,15 @@ static GCproto *bcread_proto(LexState *ls)
   pt->numline = numline;
   if (sizedbg) {
     MSize sizeli = (sizebc-1) << (numline < 256 ? 0 : numline < 65536 ? 1 : 2);
-    setmref(pt->lineinfo, (char *)pt + ofsdbg);
-    setmref(pt->uvinfo, (char *)pt + ofsdbg + sizeli);
-    bcread_dbg(ls, pt, sizedbg);
+    if (dbg) {
+      setmref(pt->lineinfo, dbg);
+      setmref(pt->uvinfo, dbg + sizeli);
+      bcread_mem(ls, sizedbg);
+    } else {
+      setmref(pt->lineinfo, (char *)pt + ofsdbg);
+      setmref(pt->uvinfo, (char *)pt + ofsdbg + sizeli);
+      bcread_dbg(ls, pt, sizedbg);
+    }
     setmref(pt->varinfo, bcread_varinfo(pt));
   } else {
     setmref(pt->lineinfo, NULL);
@@ -419,6 +434,149 @@ static GCproto *bcread_proto(LexState *ls)
   return pt;
 }
 
+/* -- Lazy prototype loading ---------------------------------------------- */
+
+/* Count child prototypes by skipping over the data of a prototype. */
+static MSize bcread_nchild(LexState *ls)
+{
+  MSize i, sizeuv, sizekgc, sizebc, n = 0;
+  if (!(bcread_byte(ls) & PROTO_CHILD))
+    return 0;
+  bcread_mem(ls, 2);  /* Skip numparams and framesize. */
+  sizeuv = bcread_byte(ls);
+  sizekgc = bcread_uleb128(ls);
+  bcread_uleb128(ls);  /* Skip sizekn. */
+  sizebc = bcread_uleb128(ls);
+  if (!(bcread_flags(ls) & BCDUMP_F_STRIP) && bcread_uleb128(ls)) {
+    bcread_uleb128(ls);  /* Skip firstline and numline. */
+    bcread_uleb128(ls);
+  }
+  bcread_mem(ls, sizebc*(MSize)sizeof(BCIns) + sizeuv*2);
+  for (i = 0; i < sizekgc; i++) {
+    MSize tp = bcread_uleb128(ls);
+    if (tp >= BCDUMP_KGC_STR) {
+      bcread_mem(ls, tp - BCDUMP_KGC_STR);
+    } else if (tp == BCDUMP_KGC_TAB) {
+      MSize nk = bcread_uleb128(ls);
+      nk += 2*bcread_uleb128(ls);
+      while (nk--) {
+	MSize tk = bcread_uleb128(ls);
+	if (tk >= BCDUMP_KTAB_STR) {
+	  bcread_mem(ls, tk - BCDUMP_KTAB_STR);
+	} else if (tk == BCDUMP_KTAB_INT) {
+	  bcread_uleb128(ls);
+	} else if (tk == BCDUMP_KTAB_NUM) {
+	  bcread_uleb128(ls);
+	  bcread_uleb128(ls);
+	}
+      }
+    } else if (tp == BCDUMP_KGC_CHILD) {
+      n++;
+    } else {
+      bcread_uleb128(ls);
+      bcread_uleb128(ls);
+      if (tp == BCDUMP_KGC_COMPLEX) {
+	bcread_uleb128(ls);
+	bcread_uleb128(ls);
+      }
+    }
+  }
+  return n;
+}
+
+/* Create a stub for a prototype. Pops its child stubs off the stack. */
+static GCproto *bcread_stub(LexState *ls, GCstr *dump)
+{
+  lua_State *L = ls->L;
+  const char *start = ls->p;
+  const char *p;
+  GCproto *pt;
+  GCRef *kr;
+  MSize len, startn, nchild, sizekgc, sizept, i;
+
+  if (ls->n > 0 && ls->p[0] == 0) {  /* Shortcut EOF. */
+    ls->n--; ls->p++;
+    return NULL;
+  }
+  bcread_want(ls, 5);
+  len = bcread_uleb128(ls);
+  if (!len) return NULL;  /* EOF */
+  bcread_need(ls, len);
+  startn = ls->n;
+  p = ls->p;
+  nchild = bcread_nchild(ls);
+  if (startn - ls->n > len || L->top - nchild < bcread_oldtop(L, ls))
+    bcread_error(ls, LJ_ERR_BCBAD);
+  ls->p = p + len;
+  ls->n = startn - len;
+
+  /* Allocate stub and initialize its fields. */
+  sizekgc = dump ? nchild+1 : nchild;
+  sizept = (MSize)sizeof(GCproto) + sizekgc*(MSize)sizeof(GCRef);
+  pt = (GCproto *)lj_mem_newgco(L, sizept);
+  pt->gct = ~LJ_TPROTO;
+  pt->numparams = 0;
+  bclazy_flags(pt) = (uint8_t)bcread_flags(ls);
+  pt->sizebc = 0;
+  setmref(pt->k, (char *)pt + sizept);
+  setmref(pt->uv, NULL);
+  pt->sizekgc = sizekgc;
+  bclazy_len(pt) = (MSize)(ls->p - start);
+  pt->sizept = sizept;
+  pt->sizeuv = 0;
+  pt->flags = nchild ? PROTO_CHILD : 0;
+  pt->trace = 0;
+  setgcref(pt->chunkname, obj2gco(ls->chunkname));
+  pt->firstline = 0;
+  pt->numline = 0;
+  setmref(pt->lineinfo, start);
+  setmref(pt->uvinfo, NULL);
+  setmref(pt->varinfo, NULL);
+
+  /* Move child stubs from the stack. Keep a copied dump alive, too. */
+  kr = mref(pt->k, GCRef) - sizekgc;
+  L->top -= nchild;
+  for (i = 0; i < nchild; i++)
+    setgcref(kr[i], obj2gco(protoV(L->top+i)));
+  if (dump)
+    setgcref(kr[nchild], obj2gco(dump));
+  return pt;
+}
+
+/* Load a prototype from its stub and replace the stub in the parent. */
+GCproto *lj_bcread_lazy(lua_State *L, GCproto *parent, GCproto *stub)
+{
+  LexState lsb, *ls = &lsb;
+  MSize i, nchild = stub->sizekgc;
+  GCRef *kr = mref(stub->k, GCRef) - stub->sizekgc;
+  GCproto *pt;
+  lua_assert(bclazy_isstub(stub));
+  if (!(bclazy_flags(stub) & BCDUMP_F_MAPPED))
+    nchild--;  /* Last constant is the copied dump. */
+  ls->L = L;
+  ls->p = bclazy_rec(stub);
+  ls->n = bclazy_len(stub);
+  ls->current = -1;  /* The whole dump is already in memory. */
+  ls->chunkname = proto_chunkname(stub);
+  ls->chunkarg = strdata(ls->chunkname);
+  bcread_flags(ls) = bclazy_flags(stub);
+  lj_state_checkstack(L, nchild);
+  bcread_savetop(L, ls, L->top);
+  for (i = 0; i < nchild; i++, L->top++)  /* Push child stubs. */
+    setprotoV(L, L->top, gco2pt(gcref(kr[i])));
+  pt = bcread_proto(ls);
+  if (!pt || ls->n != 0 || L->top != bcread_oldtop(L, ls))
+    bcread_error(ls, LJ_ERR_BCBAD);
+  pt->flags |= (stub->flags & PROTO_NOJIT);
+  if (parent) {
+    kr = mref(parent->k, GCRef) - parent->sizekgc;
+    while (gcref(*kr) != obj2gco(stub)) kr++;
+    setgcref(*kr, obj2gco(pt));
+    lj_gc_objbarrier(L, parent, pt);
+  }
+  return pt;
+}
+
 /* Read and check header of bytecode dump. */
 static int bcread_header(LexState *ls)
 {
@@ -461,6 +619,31 @@ GCproto *lj_bcread(LexState *ls)
   /* Check for a valid bytecode dump header. */
   if (!bcread_header(ls))
     bcread_error(ls, LJ_ERR_BCFMT);
+  if (ls->mapped && ls->sb.n == 0)  /* Still reading from mapped input? */
+    bcread_flags(ls) |= BCDUMP_F_MAPPED;
+  if (G(L)->lazyload) {  /* Only create stubs, then load the main chunk. */
+    GCstr *dump = NULL;
+    GCproto *pt;
+    if (!(bcread_flags(ls) & BCDUMP_F_MAPPED)) {
+      while (ls->current >= 0)  /* Need the whole dump in memory. */
+	bcread_fill(ls, ls->n+1, 0);
+      dump = lj_str_new(L, ls->p, ls->n);
+      setstrV(L, L->top, dump);
+      incr_top(L);
+      bcread_savetop(L, ls, L->top);
+      ls->p = strdata(dump);
+    }
+    ls->current = -1;  /* The whole dump is in memory now. */
+    while ((pt = bcread_stub(ls, dump)) != NULL) {
+      setprotoV(L, L->top, pt);
+      incr_top(L);
+    }
+    if ((int32_t)ls->n > 0 || L->top-1 != bcread_oldtop(L, ls))
+      bcread_error(ls, LJ_ERR_BCBAD);
+    pt = lj_bcread_lazy(L, NULL, protoV(L->top-1));
+    L->top -= dump ? 2 : 1;
+    return pt;
+  }
   for (;;) {  /* Process all prototypes in the bytecode dump. */
     GCproto *pt = bcread_proto(ls);
     if (!pt) break;
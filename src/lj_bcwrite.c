@@ -18,6 +18,7 @@
 #include "lj_jit.h"
 #endif
 #include "lj_bcdump.h"
+#include "lj_debug.h"
 #include "lj_vm.h"
 
 /* Context for bytecode writer. */
@@ -268,6 +269,23 @@ static void bcwrite_bytecode(BCWriteCtx *ctx, GCproto *pt)
 #endif
 }
 
+/* Get size of debug info. It's not colocated for mapped bytecode. */
+static MSize bcwrite_sizedbg(GCproto *pt)
+{
+  const uint8_t *p = proto_varinfo(pt);
+  for (;;) {  /* Skip to the end of varinfo. */
+    uint32_t vn = *p++;
+    if (vn < VARNAME__MAX) {
+      if (vn == VARNAME_END) break;
+    } else {
+      while (*p++) ;  /* Skip over variable name string. */
+    }
+    while (*p++ >= 0x80) ;  /* Skip startpc and endpc. */
+    while (*p++ >= 0x80) ;
+  }
+  return (MSize)(p - (const uint8_t *)proto_lineinfo(pt));
+}
+
 /* Write prototype. */
 static void bcwrite_proto(BCWriteCtx *ctx, GCproto *pt)
 {
@@ -279,8 +297,12 @@ static void bcwrite_proto(BCWriteCtx *ctx, GCproto *pt)
     GCRef *kr = mref(pt->k, GCRef) - 1;
     for (i = 0; i < n; i++, kr--) {
       GCobj *o = gcref(*kr);
-      if (o->gch.gct == ~LJ_TPROTO)
-	bcwrite_proto(ctx, gco2pt(o));
+      if (o->gch.gct == ~LJ_TPROTO) {
+	GCproto *ptc = gco2pt(o);
+	if (bclazy_isstub(ptc))
+	  ptc = lj_bcread_lazy(ctx->L, pt, ptc);
+	bcwrite_proto(ctx, ptc);
+      }
     }
   }
 
@@ -299,7 +321,7 @@ static void bcwrite_proto(BCWriteCtx *ctx, GCproto *pt)
   bcwrite_uleb128(ctx, pt->sizebc-1);
   if (!ctx->strip) {
     if (proto_lineinfo(pt))
-      sizedbg = pt->sizept - (MSize)((char *)proto_lineinfo(pt) - (char *)pt);
+      sizedbg = bcwrite_sizedbg(pt);
     bcwrite_uleb128(ctx, sizedbg);
     if (sizedbg) {
       bcwrite_uleb128(ctx, pt->firstline);
@@ -214,6 +214,65 @@ static int carith_int64(lua_State *L, CTState *cts, CDArith *ca, MMS mm)
   return 0;
 }
 
+/* Element-wise vector arithmetic. */
+static int carith_vector(lua_State *L, CTState *cts, CDArith *ca, MMS mm)
+{
+  int i = ctype_isvector(ca->ct[0]->info) ? 0 : 1;
+  CType *ctv = ca->ct[i], *cte, *ctc;
+  uint8_t *sp[2], *dp;
+  CTSize esz, ofs, step[2];
+  uint64_t splat;
+  GCcdata *cd;
+  if (!ctype_isvector(ctv->info) ||
+      !(mm == MM_add || mm == MM_sub || mm == MM_mul || mm == MM_div ||
+	mm == MM_unm))
+    return 0;
+  cte = ctype_rawchild(cts, ctv);  /* Element type. */
+  esz = cte->size;
+  if (!ctype_isnum(cte->info) || (cte->info & CTF_BOOL) || esz > 8 ||
+      (mm == MM_div && !(cte->info & CTF_FP)))
+    return 0;  /* NYI: integer vector division. */
+  sp[0] = ca->p[0]; sp[1] = ca->p[1];
+  step[0] = step[1] = esz;
+  if (ca->ct[i^1] != ctv) {  /* Splat scalar converted to element type. */
+    CType *cs = ca->ct[i^1];
+    if (!ctype_isnum(cs->info) || cs->size > 8)
+      return 0;
+    lj_cconv_ct_ct(cts, cte, cs, (uint8_t *)&splat, ca->p[i^1], 0);
+    sp[i^1] = (uint8_t *)&splat;
+    step[i^1] = 0;
+  }
+  ctc = ctype_get(cts, (cte->info & CTF_FP) ? CTID_DOUBLE : CTID_INT64);
+  cd = lj_cdata_new(cts, ctype_typeid(cts, ctv), ctv->size);
+  dp = (uint8_t *)cdataptr(cd);
+  for (ofs = 0; ofs < ctv->size; ofs += esz) {
+    union { lua_Number n; uint64_t u; } x, y;
+    lj_cconv_ct_ct(cts, ctc, cte, (uint8_t *)&x, sp[0], 0);
+    lj_cconv_ct_ct(cts, ctc, cte, (uint8_t *)&y, sp[1], 0);
+    if ((cte->info & CTF_FP)) {
+      switch (mm) {
+      case MM_add: x.n += y.n; break;
+      case MM_sub: x.n -= y.n; break;
+      case MM_mul: x.n *= y.n; break;
+      case MM_div: x.n /= y.n; break;
+      default: x.n = -x.n; break;
+      }
+    } else {
+      switch (mm) {
+      case MM_add: x.u += y.u; break;
+      case MM_sub: x.u -= y.u; break;
+      case MM_mul: x.u *= y.u; break;
+      default: x.u = (uint64_t)-(int64_t)x.u; break;
+      }
+    }
+    lj_cconv_ct_ct(cts, cte, ctc, dp + ofs, (uint8_t *)&x, 0);
+    sp[0] += step[0]; sp[1] += step[1];
+  }
+  setcdataV(L, L->top-1, cd);
+  lj_gc_check(L);
+  return 1;
+}
+
 /* Handle ctype arithmetic metamethods. */
 static int lj_carith_meta(lua_State *L, CTState *cts, CDArith *ca, MMS mm)
 {
@@ -264,7 +323,8 @@ int lj_carith_op(lua_State *L, MMS mm)
   CTState *cts = ctype_cts(L);
   CDArith ca;
   if (carith_checkarg(L, cts, &ca)) {
-    if (carith_int64(L, cts, &ca, mm) || carith_ptr(L, cts, &ca, mm)) {
+    if (carith_vector(L, cts, &ca, mm) || carith_int64(L, cts, &ca, mm) ||
+	carith_ptr(L, cts, &ca, mm)) {
       copyTV(L, &G(L)->tmptv2, L->top-1);  /* Remember for trace recorder. */
       return 1;
     }
@@ -327,6 +327,39 @@ static const char *clib_extsym(CTState *cts, CType *ct, GCstr *name)
   return strdata(name);
 }
 
+/* Resolve the symbol for a function or extern declaration. */
+static void *clib_resolve(lua_State *L, CLibrary *cl, CTState *cts, CType *ct,
+			  const char *sym)
+{
+  void *p = clib_getsym(cl, sym);
+  lua_assert(ctype_isfunc(ct->info) || ctype_isextern(ct->info));
+#if LJ_TARGET_X86 && LJ_ABI_WIN
+  /* Retry with decorated name for fastcall/stdcall functions. */
+  if (!p && ctype_isfunc(ct->info)) {
+    CTInfo cconv = ctype_cconv(ct->info);
+    if (cconv == CTCC_FASTCALL || cconv == CTCC_STDCALL) {
+      CTSize sz = clib_func_argsize(cts, ct);
+      const char *symd = lj_str_pushf(L,
+			   cconv == CTCC_FASTCALL ? "@%s@%d" : "_%s@%d",
+			   sym, sz);
+      L->top--;
+      p = clib_getsym(cl, symd);
+    }
+  }
+#else
+  UNUSED(L); UNUSED(cts); UNUSED(ct);
+#endif
+  return p;
+}
+
+/* Store a resolved symbol address as a cdata object in a cache slot. */
+static void clib_setsym(CTState *cts, TValue *tv, CTypeID id, void *p)
+{
+  GCcdata *cd = lj_cdata_new(cts, id, CTSIZE_PTR);
+  *(void **)cdataptr(cd) = p;
+  setcdataV(cts->L, tv, cd);
+}
+
 /* Index a C library by name. */
 TValue *lj_clib_index(lua_State *L, CLibrary *cl, GCstr *name)
 {
@@ -349,44 +382,68 @@ TValue *lj_clib_index(lua_State *L, CLibrary *cl, GCstr *name)
 #if LJ_TARGET_WINDOWS
       DWORD oldwerr = GetLastError();
 #endif
-      void *p = clib_getsym(cl, sym);
-      GCcdata *cd;
-      lua_assert(ctype_isfunc(ct->info) || ctype_isextern(ct->info));
-#if LJ_TARGET_X86 && LJ_ABI_WIN
-      /* Retry with decorated name for fastcall/stdcall functions. */
-      if (!p && ctype_isfunc(ct->info)) {
-	CTInfo cconv = ctype_cconv(ct->info);
-	if (cconv == CTCC_FASTCALL || cconv == CTCC_STDCALL) {
-	  CTSize sz = clib_func_argsize(cts, ct);
-	  const char *symd = lj_str_pushf(L,
-			       cconv == CTCC_FASTCALL ? "@%s@%d" : "_%s@%d",
-			       sym, sz);
-	  L->top--;
-	  p = clib_getsym(cl, symd);
-	}
-      }
-#endif
+      void *p = clib_resolve(L, cl, cts, ct, sym);
       if (!p)
 	clib_error(L, "cannot resolve symbol " LUA_QS ": %s", sym);
 #if LJ_TARGET_WINDOWS
       SetLastError(oldwerr);
 #endif
-      cd = lj_cdata_new(cts, id, CTSIZE_PTR);
-      *(void **)cdataptr(cd) = p;
-      setcdataV(L, tv, cd);
+      clib_setsym(cts, tv, id, p);
     }
   }
   return tv;
 }
 
+/* Resolve all declared functions and externs of a C library in one go.
+** Symbols which cannot be resolved in this library are silently skipped.
+** Returns the number of newly bound symbols.
+*/
+MSize lj_clib_prebind(lua_State *L, CLibrary *cl)
+{
+  CTState *cts = ctype_cts(L);
+  CTypeID id;
+  MSize n = 0;
+#if LJ_TARGET_WINDOWS
+  DWORD oldwerr = GetLastError();
+#endif
+  for (id = 1; id < cts->top; id++) {
+    CType *ct = ctype_get(cts, id);
+    if ((ctype_isfunc(ct->info) || ctype_isextern(ct->info)) &&
+	gcref(ct->name)) {
+      GCstr *name = gco2str(gcref(ct->name));
+      CType *ctn;
+      cTValue *o;
+      TValue *tv;
+      void *p;
+      if (lj_ctype_getname(cts, &ctn, name, CLNS_INDEX) != id)
+	continue;  /* Not the visible declaration for this name. */
+      o = lj_tab_getstr(cl->cache, name);
+      if (o && !tvisnil(o))
+	continue;  /* Already bound. */
+      p = clib_resolve(L, cl, cts, ct, clib_extsym(cts, ct, name));
+      if (!p)
+	continue;
+      tv = lj_tab_setstr(L, cl->cache, name);
+      clib_setsym(cts, tv, id, p);
+      n++;
+    }
+  }
+#if LJ_TARGET_WINDOWS
+  SetLastError(oldwerr);
+#endif
+  return n;
+}
+
 /* -- C library management ------------------------------------------------ */
 
 /* Create a new CLibrary object and push it on the stack. */
-static CLibrary *clib_new(lua_State *L, GCtab *mt)
+static CLibrary *clib_new(lua_State *L, GCtab *mt, GCtab *t)
 {
-  GCtab *t = lj_tab_new(L, 0, 0);
-  GCudata *ud = lj_udata_new(L, sizeof(CLibrary), t);
-  CLibrary *cl = (CLibrary *)uddata(ud);
+  GCudata *ud;
+  CLibrary *cl;
+  if (!t) t = lj_tab_new(L, 0, 0);
+  ud = lj_udata_new(L, sizeof(CLibrary), t);
+  cl = (CLibrary *)uddata(ud);
   cl->cache = t;
   ud->udtype = UDTYPE_FFI_CLIB;
   /* NOBARRIER: The GCudata is new (marked white). */
@@ -395,17 +452,44 @@ static CLibrary *clib_new(lua_State *L, GCtab *mt)
   return cl;
 }
 
-/* Load a C library. */
+/* Load a C library.
+**
+** The dynamic loader returns the same reference-counted handle if a library
+** is loaded more than once. All namespaces for the same handle share one
+** symbol cache, which is kept in the clib metatable under the handle. So
+** repeated ffi.load() calls (e.g. one per coroutine) only resolve each
+** symbol once per VM.
+*/
 void lj_clib_load(lua_State *L, GCtab *mt, GCstr *name, int global)
 {
   void *handle = clib_loadlib(L, strdata(name), global);
-  CLibrary *cl = clib_new(L, mt);
+  TValue key;
+  cTValue *tv;
+  GCtab *t = NULL;
+  CLibrary *cl;
+  setlightudV(&key, checklightudptr(L, handle));
+  tv = lj_tab_get(L, mt, &key);
+  if (tvistab(tv)) t = tabV(tv);
+  cl = clib_new(L, mt, t);
   cl->handle = handle;
+  if (!t) {
+    settabV(L, lj_tab_set(L, mt, &key), cl->cache);
+    lj_gc_anybarriert(L, mt);
+  }
 }
 
 /* Unload a C library. */
-void lj_clib_unload(CLibrary *cl)
+void lj_clib_unload(lua_State *L, GCtab *mt, CLibrary *cl)
 {
+  if (cl->handle) {
+    TValue key;
+    cTValue *tv;
+    setlightudV(&key, checklightudptr(L, cl->handle));
+    tv = lj_tab_get(L, mt, &key);
+    /* Drop the shared cache. The handle may be reused after unloading. */
+    if (tvistab(tv) && tabV(tv) == cl->cache)
+      setnilV((TValue *)tv);
+  }
   clib_unloadlib(cl);
   cl->handle = NULL;
 }
@@ -413,7 +497,7 @@ void lj_clib_unload(CLibrary *cl)
 /* Create the default C library object. */
 void lj_clib_default(lua_State *L, GCtab *mt)
 {
-  CLibrary *cl = clib_new(L, mt);
+  CLibrary *cl = clib_new(L, mt, NULL);
   cl->handle = CLIB_DEFHANDLE;
 }
 
@@ -1065,43 +1065,43 @@ static void cp_decl_gccattribute(CPState *cp, CPDecl *decl)
       GCstr *attrstr = cp->str;
       cp_next(cp);
       switch (attrstr->hash) {
-      case H_(64a9208e,8ce14319): case H_(8e6331b2,95a282af):  /* aligned */
+      case H_(64a9208e,8ce14319): case H_(373086c4,cea65daa):  /* aligned */
 	cp_decl_align(cp, decl);
 	break;
-      case H_(42eb47de,f0ede26c): case H_(29f48a09,cf383e0c):  /* packed */
+      case H_(42eb47de,f0ede26c): case H_(e66095b6,75184e63):  /* packed */
 	decl->attr |= CTFP_PACKED;
 	break;
       case H_(0a84eef6,8dfab04c): case H_(995cf92c,d5696591):  /* mode */
 	cp_decl_mode(cp, decl);
 	break;
-      case H_(0ab31997,2d5213fa): case H_(bf875611,200e9990):  /* vector_size */
+      case H_(afbd204d,6a62eaad): case H_(09148c9a,1bc8f53d):  /* vector_size */
 	{
 	  CTSize vsize = cp_decl_sizeattr(cp);
 	  if (vsize) CTF_INSERT(decl->attr, VSIZEP, lj_fls(vsize));
 	}
 	break;
 #if LJ_TARGET_X86
-      case H_(5ad22db8,c689b848): case H_(439150fa,65ea78cb):  /* regparm */
+      case H_(5ad22db8,c689b848): case H_(1e6b0f00,4237a925):  /* regparm */
 	CTF_INSERT(decl->fattr, REGPARM, cp_decl_sizeattr(cp));
 	decl->fattr |= CTFP_CCONV;
 	break;
-      case H_(18fc0b98,7ff4c074): case H_(4e62abed,0a747424):  /* cdecl */
+      case H_(18fc0b98,7ff4c074): case H_(46a80347,0903b331):  /* cdecl */
 	CTF_INSERT(decl->fattr, CCONV, CTCC_CDECL);
 	decl->fattr |= CTFP_CCONV;
 	break;
-      case H_(72b2e41b,494c5a44): case H_(f2356d59,f25fc9bd):  /* thiscall */
+      case H_(72b2e41b,494c5a44): case H_(ba706840,ccfe376e):  /* thiscall */
 	CTF_INSERT(decl->fattr, CCONV, CTCC_THISCALL);
 	decl->fattr |= CTFP_CCONV;
 	break;
-      case H_(0d0ffc42,ab746f88): case H_(21c54ba1,7f0ca7e3):  /* fastcall */
+      case H_(0d0ffc42,ab746f88): case H_(5eec9c91,84e6ac11):  /* fastcall */
 	CTF_INSERT(decl->fattr, CCONV, CTCC_FASTCALL);
 	decl->fattr |= CTFP_CCONV;
 	break;
-      case H_(ef76b040,9412e06a): case H_(de56697b,c750e6e1):  /* stdcall */
+      case H_(ef76b040,9412e06a): case H_(a3d42cb7,f8c51938):  /* stdcall */
 	CTF_INSERT(decl->fattr, CCONV, CTCC_STDCALL);
 	decl->fattr |= CTFP_CCONV;
 	break;
-      case H_(ea78b622,f234bd8e): case H_(252ffb06,8d50f34b):  /* sseregparm */
+      case H_(f1dea636,ce15216e): case H_(118fdb6a,431c1758):  /* sseregparm */
 	decl->fattr |= CTF_SSEREGPARM;
 	decl->fattr |= CTFP_CCONV;
 	break;
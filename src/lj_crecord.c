@@ -241,6 +241,7 @@ static void crec_copy(jit_State *J, TRef trdst, TRef trsrc, TRef trlen,
 	CType *cct = ctype_rawchild(cts, ct);
 	tp = crec_ct2irt(cts, cct);
 	if (tp == IRT_CDATA) goto rawcopy;
+	if (tp == IRT_I64 || tp == IRT_U64) lj_needsplit(J);
 	step = lj_ir_type_size[tp];
 	lua_assert((len & (step-1)) == 0);
       } else if ((ct->info & CTF_UNION)) {
@@ -500,9 +501,28 @@ static TRef crec_ct_ct(jit_State *J, CType *d, CType *s, TRef dp, TRef sp,
   /* Destination is a vector. */
   case CCX(V, I):
   case CCX(V, F):
-  case CCX(V, C):
+    if (dp == 0) goto err_conv;
+    {  /* Convert the scalar to the element type, then splat it. */
+      CTState *cts = ctype_ctsG(J2G(J));
+      CType *dc = ctype_rawchild(cts, d);
+      CTSize ofs;
+      dt = crec_ct2irt(cts, dc);
+      if (dt == IRT_CDATA || dsize > dc->size*CREC_COPY_MAXUNROLL)
+	goto err_nyi;
+      sp = crec_ct_ct(J, dc, s, 0, sp, svisnz);
+      for (ofs = 0; ofs < dsize; ofs += dc->size) {
+	TRef ptr = ofs ? emitir(IRT(IR_ADD, IRT_PTR), dp, lj_ir_kintp(J, ofs)) :
+		   dp;
+	emitir(IRT(IR_XSTORE, dt), ptr, sp);
+      }
+    }
+    break;
   case CCX(V, V):
-    goto err_nyi;
+    /* Copy same-sized vectors, even for different lengths/element-types. */
+    if (dp == 0 || dsize != ssize) goto err_conv;
+    crec_copy(J, dp, sp, lj_ir_kint(J, dsize),
+	      ctype_cid(dinfo) == ctype_cid(sinfo) ? d : NULL);
+    break;
 
   /* Destination is a pointer. */
   case CCX(P, P):
@@ -583,8 +603,12 @@ static TRef crec_tv_ct(jit_State *J, CType *s, CTypeID sid, TRef sp)
     ptr = emitir(IRT(IR_ADD, IRT_PTR), dp, lj_ir_kintp(J, sizeof(GCcdata)+esz));
     emitir(IRT(IR_XSTORE, t), ptr, tr2);
     return dp;
+  } else if (ctype_isvector(sinfo)) {  /* Copy vector by value. */
+    TRef dp = emitir(IRTG(IR_CNEW, IRT_CDATA), lj_ir_kint(J, sid), TREF_NIL);
+    TRef ptr = emitir(IRT(IR_ADD, IRT_PTR), dp, lj_ir_kintp(J, sizeof(GCcdata)));
+    crec_copy(J, ptr, sp, lj_ir_kint(J, s->size), s);
+    return dp;
   } else {
-    /* NYI: copyval of vectors. */
   err_nyi:
     lj_trace_err(J, LJ_TRERR_NYICONV);
   }
@@ -719,10 +743,33 @@ static void crec_index_meta(jit_State *J, CTState *cts, CType *ct,
       lj_trace_err(J, LJ_TRERR_BADTYPE);
     /* Always specialize to the key. */
     emitir(IRTG(IR_EQ, IRT_STR), J->base[1], lj_ir_kstr(J, strV(&rd->argv[1])));
+  } else if (tvistab(tv)) {
+    /* Index the __index/__newindex table. It's constant for this ctype. */
+    GCtab *t = tabV(tv);
+    RecordIndex ix;
+    if (tvisnil(lj_tab_get(J->L, t, &rd->argv[1]))) {
+      GCtab *mt = tabref(t->metatable);
+      /* NYI: lookups that fail (interpreter throws) or need metamethods. */
+      if (rd->data == 0 || (mt && !tvisnil(lj_tab_getstr(mt,
+				     mmname_str(J2G(J), MM_newindex)))))
+	lj_trace_err(J, LJ_TRERR_BADTYPE);
+    }
+    ix.tab = lj_ir_ktab(J, t);
+    settabV(J->L, &ix.tabv, t);
+    ix.key = J->base[1];
+    copyTV(J->L, &ix.keyv, &rd->argv[1]);
+    ix.idxchain = 1;  /* Only checks for metamethods, never resolves them. */
+    if (rd->data == 0) {
+      ix.val = 0;
+      J->base[0] = lj_record_idx(J, &ix);
+    } else {
+      ix.val = J->base[2];
+      copyTV(J->L, &ix.valv, &rd->argv[2]);
+      lj_record_idx(J, &ix);
+      rd->nres = 0;
+    }
   } else {
-    /* NYI: resolving of non-function metamethods. */
-    /* NYI: non-string keys for __index table. */
-    /* NYI: stores to __newindex table. */
+    /* NYI: resolving of non-function, non-table metamethods. */
     lj_trace_err(J, LJ_TRERR_BADTYPE);
   }
 }
@@ -1203,6 +1250,67 @@ void LJ_FASTCALL recff_cdata_call(jit_State *J, RecordFFData *rd)
   lj_trace_err(J, LJ_TRERR_BADTYPE);
 }
 
+/* Element-wise vector arithmetic. This mirrors carith_vector(). */
+static TRef crec_arith_vector(jit_State *J, TRef *sp, CType **s, MMS mm)
+{
+  CTState *cts = ctype_ctsG(J2G(J));
+  int i = ctype_isvector(s[0]->info) ? 0 : 1;
+  CType *ctv = s[i], *cte;
+  IRType et, ct;
+  TRef trcd, splat = 0;
+  CTSize esz, ofs;
+  if (!ctype_isvector(ctv->info) ||
+      !(mm == MM_add || mm == MM_sub || mm == MM_mul || mm == MM_div ||
+	mm == MM_unm))
+    return 0;
+  cte = ctype_rawchild(cts, ctv);
+  esz = cte->size;
+  et = crec_ct2irt(cts, cte);
+  if (!ctype_isnum(cte->info) || (cte->info & CTF_BOOL) || et == IRT_CDATA ||
+      (mm == MM_div && !(cte->info & CTF_FP)))
+    return 0;
+  if (ctv->size > esz*CREC_COPY_MAXUNROLL)
+    lj_trace_err(J, LJ_TRERR_NYICONV);  /* NYI: wide vectors. */
+  /* Compute type: FP lanes in double, small integer lanes in int. */
+  ct = (cte->info & CTF_FP) ? IRT_NUM : esz == 8 ? et : IRT_INT;
+  if (s[i^1] != ctv) {  /* Splat scalar converted to element type. */
+    if (!ctype_isnum(s[i^1]->info) || s[i^1]->size > 8 || !sp[i^1])
+      return 0;
+    splat = crec_ct_ct(J, cte, s[i^1], 0, sp[i^1], NULL);
+    if (et == IRT_FLOAT) splat = emitconv(splat, IRT_NUM, IRT_FLOAT, 0);
+  }
+  if (esz == 8 && ct != IRT_NUM) lj_needsplit(J);
+  trcd = emitir(IRTG(IR_CNEW, IRT_CDATA),
+		lj_ir_kint(J, ctype_typeid(cts, ctv)), TREF_NIL);
+  for (ofs = 0; ofs < ctv->size; ofs += esz) {
+    TRef tr[2], ptr;
+    MSize j;
+    for (j = 0; j < 2; j++) {
+      if (s[j] != ctv) {
+	tr[j] = splat;
+      } else {
+	ptr = emitir(IRT(IR_ADD, IRT_PTR), sp[j], lj_ir_kintp(J, ofs));
+	tr[j] = emitir(IRT(IR_XLOAD, esz == 4 && ct == IRT_INT ? IRT_INT : et),
+		       ptr, 0);
+	if (et == IRT_FLOAT) tr[j] = emitconv(tr[j], IRT_NUM, IRT_FLOAT, 0);
+      }
+    }
+    if (mm == MM_unm) {
+      tr[0] = ct == IRT_NUM ?
+	      emitir(IRTN(IR_NEG), tr[0], lj_ir_knum_neg(J)) :
+	      emitir(IRT(IR_SUB, ct), ct == IRT_INT ? lj_ir_kint(J, 0) :
+				      lj_ir_kint64(J, 0), tr[0]);
+    } else {
+      tr[0] = emitir(IRT(mm+(int)IR_ADD-(int)MM_add, ct), tr[0], tr[1]);
+    }
+    if (et == IRT_FLOAT) tr[0] = emitconv(tr[0], IRT_FLOAT, IRT_NUM, 0);
+    ptr = emitir(IRT(IR_ADD, IRT_PTR), trcd,
+		 lj_ir_kintp(J, ofs + sizeof(GCcdata)));
+    emitir(IRT(IR_XSTORE, et), ptr, tr[0]);
+  }
+  return trcd;
+}
+
 static TRef crec_arith_int64(jit_State *J, TRef *sp, CType **s, MMS mm)
 {
   if (ctype_isnum(s[0]->info) && ctype_isnum(s[1]->info)) {
@@ -1269,10 +1377,21 @@ static TRef crec_arith_ptr(jit_State *J, TRef *sp, CType **s, MMS mm)
       if (mm == MM_sub) {  /* Pointer difference. */
 	TRef tr;
 	CTSize sz = lj_ctype_size(cts, ctype_cid(ctp->info));
-	if (sz == 0 || (sz & (sz-1)) != 0)
-	  return 0;  /* NYI: integer division. */
+	if (sz == 0)
+	  return 0;
 	tr = emitir(IRT(IR_SUB, IRT_INTP), sp[0], sp[1]);
-	tr = emitir(IRT(IR_BSAR, IRT_INTP), tr, lj_ir_kint(J, lj_fls(sz)));
+	if ((sz & (sz-1)) == 0) {
+	  tr = emitir(IRT(IR_BSAR, IRT_INTP), tr, lj_ir_kint(J, lj_fls(sz)));
+	} else {  /* Divide by element size. */
+#if !LJ_64
+	  tr = emitconv(tr, IRT_I64, IRT_INT, IRCONV_SEXT);
+	  lj_needsplit(J);
+#endif
+	  tr = emitir(IRT(IR_DIV, IRT_I64), tr, lj_ir_kint64(J, sz));
+#if !LJ_64
+	  tr = emitconv(tr, IRT_INT, IRT_I64, 0);
+#endif
+	}
 #if LJ_64
 	tr = emitconv(tr, IRT_NUM, IRT_INTP, 0);
 #endif
@@ -1441,7 +1560,8 @@ void LJ_FASTCALL recff_cdata_arith(jit_State *J, RecordFFData *rd)
   }
   {
     TRef tr;
-    if (!(tr = crec_arith_int64(J, sp, s, (MMS)rd->data)) &&
+    if (!(tr = crec_arith_vector(J, sp, s, (MMS)rd->data)) &&
+	!(tr = crec_arith_int64(J, sp, s, (MMS)rd->data)) &&
 	!(tr = crec_arith_ptr(J, sp, s, (MMS)rd->data)) &&
 	!(tr = crec_arith_meta(J, sp, s, cts, rd)))
       return;
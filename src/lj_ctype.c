@@ -201,7 +201,7 @@ CTypeID lj_ctype_intern(CTState *cts, CTInfo info, CTSize size)
 }
 
 /* Add type element to hash table. */
-static void ctype_addtype(CTState *cts, CType *ct, CTypeID id)
+void lj_ctype_addtype(CTState *cts, CType *ct, CTypeID id)
 {
   uint32_t h = ct_hashtype(ct->info, ct->size);
   ct->next = cts->hash[h];
@@ -612,7 +612,7 @@ CTState *lj_ctype_init(lua_State *L)
     } else {
       setgcrefnull(ct->name);
       ct->next = 0;
-      if (!ctype_isenum(info)) ctype_addtype(cts, ct, id);
+      if (!ctype_isenum(info)) lj_ctype_addtype(cts, ct, id);
     }
   }
   setmref(G(L)->ctype_state, cts);
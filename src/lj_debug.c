@@ -18,6 +18,7 @@
 #if LJ_HASJIT
 #include "lj_jit.h"
 #endif
+#include "luajit.h"
 
 /* -- Frames -------------------------------------------------------------- */
 
@@ -49,12 +50,24 @@ cTValue *lj_debug_frame(lua_State *L, int level, int *size)
 /* Invalid bytecode position. */
 #define NO_BCPOS	(~(BCPos)0)
 
+/* Return bytecode position for the PC saved in the frame above. */
+static BCPos debug_bcpos(GCproto *pt, const BCIns *ins)
+{
+  BCPos pos = proto_bcpos(pt, ins) - 1;
+#if LJ_HASJIT
+  if (pos > pt->sizebc) {  /* Undo the effects of lj_trace_exit for JLOOP. */
+    GCtrace *T = (GCtrace *)((char *)(ins-1) - offsetof(GCtrace, startins));
+    lua_assert(bc_isret(bc_op(ins[-1])));
+    pos = proto_bcpos(pt, mref(T->startpc, const BCIns));
+  }
+#endif
+  return pos;
+}
+
 /* Return bytecode position for function/frame or NO_BCPOS. */
 static BCPos debug_framepc(lua_State *L, GCfunc *fn, cTValue *nextframe)
 {
   const BCIns *ins;
-  GCproto *pt;
-  BCPos pos;
   lua_assert(fn->c.gct == ~LJ_TFUNC || fn->c.gct == ~LJ_TTHREAD);
   if (!isluafunc(fn)) {  /* Cannot derive a PC for non-Lua functions. */
     return NO_BCPOS;
@@ -96,16 +109,7 @@ static BCPos debug_framepc(lua_State *L, GCfunc *fn, cTValue *nextframe)
       ins = cframe_pc(cf);
     }
   }
-  pt = funcproto(fn);
-  pos = proto_bcpos(pt, ins) - 1;
-#if LJ_HASJIT
-  if (pos > pt->sizebc) {  /* Undo the effects of lj_trace_exit for JLOOP. */
-    GCtrace *T = (GCtrace *)((char *)(ins-1) - offsetof(GCtrace, startins));
-    lua_assert(bc_isret(bc_op(ins[-1])));
-    pos = proto_bcpos(pt, mref(T->startpc, const BCIns));
-  }
-#endif
-  return pos;
+  return debug_bcpos(funcproto(fn), ins);
 }
 
 /* -- Line numbers -------------------------------------------------------- */
@@ -552,6 +556,96 @@ LUA_API int lua_getstack(lua_State *L, int level, lua_Debug *ar)
   }
 }
 
+/* -- Raw stack capture --------------------------------------------------- */
+
+/* Capture functions and PCs of up to n frames, starting at level.
+** Same frame walk as lj_debug_frame() plus debug_framepc(), but in a
+** single pass that tracks the C frames alongside. Doesn't allocate.
+*/
+LUA_API int luaJIT_getframes(lua_State *L, int level, luaJIT_Frame *fr, int n)
+{
+  cTValue *frame, *nextframe = NULL, *bot = tvref(L->stack);
+  void *cf = cframe_raw(L->cframe);
+  int skip = 0, i = 0;
+  for (frame = L->base-1; frame > bot && i < n; ) {
+    /* Drop C frames of protected calls entered above this frame. */
+    while (cf && cframe_nres(cf) < 0 &&
+	   frame < restorestack(L, -cframe_nres(cf)))
+      cf = cframe_raw(cframe_prev(cf));
+    if (skip || frame_gc(frame) == obj2gco(L)) {
+      skip = 0;  /* Skip vararg pseudo-frame or dummy frame. */
+    } else if (level > 0) {
+      level--;
+    } else {
+      GCfunc *fn = frame_func(frame);
+      if (isluafunc(fn)) {
+	const BCIns *ins = NULL;
+	if (nextframe == NULL) {  /* Lua function on top. */
+	  void *cft = cframe_raw(L->cframe);
+	  if (cft && (char *)cframe_pc(cft) != (char *)cframe_L(cft))
+	    ins = cframe_pc(cft);
+	} else if (frame_islua(nextframe)) {
+	  ins = frame_pc(nextframe);
+	} else if (frame_iscont(nextframe)) {
+	  ins = frame_contpc(nextframe);
+	} else if (cf) {
+	  ins = cframe_pc(cf);
+	}
+	fr[i].func = funcproto(fn);
+	fr[i].pc = (int)(ins ? debug_bcpos(funcproto(fn), ins) :
+			       funcproto(fn)->sizebc);  /* Unknown PC. */
+      } else {
+	fr[i].func = (const void *)fn->c.f;
+	fr[i].pc = -1;
+      }
+      i++;
+    }
+    nextframe = frame;
+    if (frame_islua(frame)) {
+      frame = frame_prevl(frame);
+    } else {
+      if (frame_isvarg(frame))
+	skip = 1;
+      else if (cf && (frame_isc(frame) ||
+		      (LJ_HASFFI && frame_iscont(frame) &&
+		       (frame-1)->u32.lo == LJ_CONT_FFI_CALLBACK)))
+	cf = cframe_raw(cframe_prev(cf));
+      frame = frame_prevd(frame);
+    }
+  }
+  return i;
+}
+
+/* Symbolize a captured frame. The prototype must still be alive. */
+LUA_API int luaJIT_getframeinfo(const luaJIT_Frame *fr, lua_Debug *ar)
+{
+  ar->name = NULL;
+  ar->namewhat = "";
+  ar->nups = 0;
+  if (fr->pc >= 0) {
+    GCproto *pt = (GCproto *)fr->func;
+    ar->source = proto_chunknamestr(pt);
+    lj_debug_shortname(ar->short_src, proto_chunkname(pt));
+    ar->linedefined = (int)pt->firstline;
+    ar->lastlinedefined = (int)(pt->firstline + pt->numline);
+    ar->what = pt->firstline ? "Lua" : "main";
+    ar->currentline = (BCPos)fr->pc < pt->sizebc ?
+		      (int)lj_debug_line(pt, (BCPos)fr->pc) : -1;
+    return 1;
+  } else {
+    ar->source = "=[C]";
+    ar->short_src[0] = '[';
+    ar->short_src[1] = 'C';
+    ar->short_src[2] = ']';
+    ar->short_src[3] = '\0';
+    ar->linedefined = -1;
+    ar->lastlinedefined = -1;
+    ar->what = "C";
+    ar->currentline = -1;
+    return 0;
+  }
+}
+
 /* Number of frames for the leading and trailing part of a traceback. */
 #define TRACEBACK_LEVELS1	12
 #define TRACEBACK_LEVELS2	10
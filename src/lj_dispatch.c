@@ -24,6 +24,7 @@
 #include "lj_ccallback.h"
 #endif
 #include "lj_trace.h"
+#include "lj_perf.h"
 #include "lj_dispatch.h"
 #include "lj_vm.h"
 #include "luajit.h"
@@ -271,11 +272,16 @@ int luaJIT_setmode(lua_State *L, int idx, int mode)
       return 0;  /* Failed. */
     lj_trace_flush(G2J(g), idx);
     break;
+  case LUAJIT_MODE_PERF:
+    if (!lj_perf_setmode(G2J(g), idx, (mode & LUAJIT_MODE_ON)))
+      return 0;  /* Failed or not compiled in. */
+    break;
 #else
   case LUAJIT_MODE_ENGINE:
   case LUAJIT_MODE_FUNC:
   case LUAJIT_MODE_ALLFUNC:
   case LUAJIT_MODE_ALLSUBFUNC:
+  case LUAJIT_MODE_PERF:
     UNUSED(idx);
     if ((mode & LUAJIT_MODE_ON))
       return 0;  /* Failed. */
@@ -297,12 +303,84 @@ int luaJIT_setmode(lua_State *L, int idx, int mode)
       g->bc_cfunc_ext = BCINS_AD(BC_FUNCC, 0, 0);
     }
     break;
+  case LUAJIT_MODE_LAZYLOAD:
+    g->lazyload = (uint8_t)((mode & LUAJIT_MODE_ON) != 0);
+    break;
   default:
     return 0;  /* Failed. */
   }
   return 1;  /* OK. */
 }
 
+#if LJ_HASJIT
+static void setstatfield(lua_State *L, GCtab *t, const char *name,
+			 lua_Number n)
+{
+  setnumV(lj_tab_setstr(L, t, lj_str_newz(L, name)), n);
+}
+#endif
+
+/* Public API function: push table with trace compiler statistics. */
+int luaJIT_getstats(lua_State *L, int reset)
+{
+#if LJ_HASJIT
+  jit_State *J = L2J(L);
+  TraceStats *st = &J->stats;
+  GCtab *t, *tr;
+  MSize i, n = 0;
+  lj_gc_check(L);
+  t = lj_tab_new(L, 0, 4);
+  settabV(L, L->top, t);
+  incr_top(L);
+  setstatfield(L, t, "start", (lua_Number)st->start);
+  setstatfield(L, t, "startside", (lua_Number)st->startside);
+  setstatfield(L, t, "stop", (lua_Number)st->stop);
+  setstatfield(L, t, "abort", (lua_Number)st->abort);
+  setstatfield(L, t, "flush", (lua_Number)st->flush);
+  setstatfield(L, t, "exits", (lua_Number)st->exits);
+  setstatfield(L, t, "mcode", (lua_Number)st->mcode);
+  setstatfield(L, t, "mcarea", (lua_Number)J->szallmcarea);
+  setstatfield(L, t, "ctime", st->ctime);
+  for (i = 1; i < J->sizetrace; i++)
+    if (traceref(J, i)) n++;
+  setstatfield(L, t, "traces", (lua_Number)n);
+  /* Aborts by reason: reason[code] = count. */
+  tr = lj_tab_new(L, STATERR_MAX, 0);
+  settabV(L, lj_tab_setstr(L, t, lj_str_newlit(L, "reason")), tr);
+  for (i = 0; i < STATERR_MAX; i++)
+    if (st->reason[i])
+      setnumV(lj_tab_setint(L, tr, (int32_t)i), (lua_Number)st->reason[i]);
+  /* Aborts by location: loc[i] = { source=, line=, count=, reason= }. */
+  tr = lj_tab_new(L, STATLOC_SLOTS+1, 0);
+  settabV(L, lj_tab_setstr(L, t, lj_str_newlit(L, "loc")), tr);
+  for (i = 0, n = 0; i < STATLOC_SLOTS; i++) {
+    TraceStatLoc *loc = &st->loc[i];
+    if (loc->count) {
+      GCtab *tl = lj_tab_new(L, 0, 2);
+      n++;
+      settabV(L, lj_tab_setint(L, tr, (int32_t)n), tl);
+      setstrV(L, lj_tab_setstr(L, tl, lj_str_newlit(L, "source")),
+	      lj_str_newz(L, loc->name));
+      setstatfield(L, tl, "line", (lua_Number)loc->line);
+      setstatfield(L, tl, "count", (lua_Number)loc->count);
+      setstatfield(L, tl, "reason", (lua_Number)loc->reason);
+    }
+  }
+  if (reset) {
+    double cstart = st->cstart;  /* Keep for a trace being recorded. */
+    memset(st, 0, sizeof(TraceStats));
+    st->cstart = cstart;
+    for (i = 1; i < J->sizetrace; i++)  /* Per-trace exit counts, too. */
+      if (traceref(J, i))
+	traceref(J, i)->exits = 0;
+  }
+  return 1;
+#else
+  UNUSED(L); UNUSED(reset);
+  return 0;
+#endif
+}
+
 /* Enforce (dynamic) linker error for version mismatches. See luajit.c. */
 LUA_API void LUAJIT_VERSION_SYM(void)
 {
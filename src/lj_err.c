@@ -548,7 +548,7 @@ static ptrdiff_t finderrfunc(lua_State *L)
 }
 
 /* Runtime error. */
-LJ_NOINLINE void lj_err_run(lua_State *L)
+static void err_callerrfunc(lua_State *L)
 {
   ptrdiff_t ef = finderrfunc(L);
   if (ef) {
@@ -565,9 +565,39 @@ LJ_NOINLINE void lj_err_run(lua_State *L)
     L->top = top+1;
     lj_vm_call(L, top, 1+1);  /* Stack: |errfunc|msg| -> |msg| */
   }
+}
+
+LJ_NOINLINE void lj_err_run(lua_State *L)
+{
+  err_callerrfunc(L);
   lj_err_throw(L, LUA_ERRRUN);
 }
 
+/* Runtime error raised by a C function called from the interpreter.
+**
+** If the error is caught by a pcall() in the same C frame, there's nothing
+** to unwind on the C stack. Unwind the Lua stack right here and return -2.
+** The interpreter then continues at the pcall() landing pad. This avoids
+** the (rather slow) external unwinder, e.g. for error() used as control flow.
+*/
+LJ_NOINLINE int lj_err_runc(lua_State *L)
+{
+  err_callerrfunc(L);
+#if LJ_TARGET_X86ORX64
+  if (err_unwind(L, NULL, 0) ==
+      (void *)((intptr_t)L->cframe | CFRAME_UNWIND_FF)) {
+    global_State *g = G(L);
+    lj_trace_abort(g);
+    setgcrefnull(g->jit_L);
+    L->status = 0;
+    err_unwind(L, NULL, LUA_ERRRUN);
+    return -2;
+  }
+#endif
+  lj_err_throw(L, LUA_ERRRUN);
+  return 0;  /* unreachable */
+}
+
 /* Formatted runtime error message. */
 LJ_NORET LJ_NOINLINE static void err_msgv(lua_State *L, ErrMsg em, ...)
 {
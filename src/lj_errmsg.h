@@ -78,6 +78,7 @@ ERRDEF(SETFENV,	LUA_QL("setfenv") " cannot change environment of given object")
 ERRDEF(CORUN,	"cannot resume running coroutine")
 ERRDEF(CODEAD,	"cannot resume dead coroutine")
 ERRDEF(COSUSP,	"cannot resume non-suspended coroutine")
+ERRDEF(CORECY,	"cannot recycle running coroutine")
 ERRDEF(TABINS,	"wrong number of arguments to " LUA_QL("insert"))
 ERRDEF(TABCAT,	"invalid value (%s) at index %d in table for " LUA_QL("concat"))
 ERRDEF(TABSORT,	"invalid order function for sorting")
@@ -153,6 +154,12 @@ ERRDEF(XGSCOPE,	"<goto %s> jumps into the scope of local " LUA_QS)
 ERRDEF(BCFMT,	"cannot load incompatible bytecode")
 ERRDEF(BCBAD,	"cannot load malformed bytecode")
 
+/* Heap image errors. */
+ERRDEF(IMGFMT,	"cannot load incompatible heap image")
+ERRDEF(IMGBAD,	"cannot load malformed heap image")
+ERRDEF(IMGREF,	"heap image refers to missing " LUA_QS)
+ERRDEF(IMGOBJ,	"cannot snapshot %s")
+
 #if LJ_HASFFI
 /* FFI errors. */
 ERRDEF(FFI_INVTYPE,	"invalid C type")
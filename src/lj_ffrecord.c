@@ -105,20 +105,104 @@ LJ_NORET static void recff_nyiu(jit_State *J)
   lj_trace_err_info(J, LJ_TRERR_NYIFFU);
 }
 
+#if LJ_TARGET_X86ORX64
+/* Stop the trace at a call to a builtin that cannot be recorded and stitch
+** the next trace to it. The called function gets a continuation frame,
+** which starts or enters the next trace after the builtin returns.
+*/
+static int recff_stitch(jit_State *J)
+{
+  lua_State *L = J->L;
+  TValue *base = L->base;
+  BCReg nslot = J->maxslot + 1;  /* Function + arguments. */
+  TValue *nframe = base + 1;
+  const BCIns *pc;
+  TValue *pframe;
+  ASMFunction cont = lj_cont_stitch;
+  TRef trcont, trprev;
+  if (J->framedepth == 0 || !frame_islua(base-1))
+    return 0;  /* Can only stitch from a Lua call. */
+  pc = frame_pc(base-1);
+  switch (bc_op(*pc)) {
+  case BC_CALLM: case BC_CALLMT: case BC_RETM: case BC_TSETM:
+    return 0;  /* Stitched trace cannot start with a variable # of results. */
+  default:
+    break;
+  }
+  switch (J->fn->c.ffid) {
+  case FF_error: case FF_debug_sethook: case FF_jit_flush:
+    return 0;  /* Don't stitch across special builtins. */
+  default:
+    break;
+  }
+  if (J->baseslot + J->maxslot + 2 >= LJ_MAX_JSLOTS ||
+      tvref(L->maxstack) - L->top < 2)
+    return 0;
+  /* Check for errors before touching the stack, which isn't restored on
+  ** a trace abort. Stopping the trace adds one more snapshot.
+  */
+  if (J->cur.nsnap >= (MSize)J->param[JIT_P_maxsnap])
+    lj_trace_err(J, LJ_TRERR_SNAPOV);
+#if LJ_64
+  trcont = lj_ir_kptr(J, (void *)((int64_t)cont - (int64_t)lj_vm_asm_begin));
+#else
+  trcont = lj_ir_kptr(J, (void *)cont);
+#endif
+  trprev = lj_ir_knum(J, (lua_Number)J->cur.traceno);
+  pframe = frame_prevl(base-1);
+
+  /* Move function + arguments up and insert the continuation frame. */
+  memmove(&base[1], &base[-1], sizeof(TValue)*nslot);
+  setframe_ftsz(nframe, (int)((char *)nframe - (char *)pframe) + FRAME_CONT);
+  setcont(base, cont);
+  setframe_pc(base, pc);
+  setnilV(base-1);  /* Holds the previous trace number, see below. */
+  L->base += 2;
+  L->top += 2;
+
+  /* Ditto for the IR. The slot below the continuation passes the number of
+  ** the current trace to lj_cont_stitch. It's a number to keep it GC-safe.
+  */
+  memmove(&J->base[1], &J->base[-1], sizeof(TRef)*nslot);
+  J->base[0] = trcont | TREF_CONT;
+  J->base[-1] = trprev;
+  J->base += 2;
+  J->baseslot += 2;
+  J->framedepth++;
+
+  lj_record_stop(J, LJ_TRLINK_STITCH, 0);
+
+  /* Undo the changes to the Lua stack. */
+  memmove(&base[-1], &base[1], sizeof(TValue)*nslot);
+  setframe_pc(base-1, pc);
+  L->base -= 2;
+  L->top -= 2;
+  return 1;
+}
+#else
+#define recff_stitch(J)		0
+#endif
+
 /* Fallback handler for all fast functions that are not recorded (yet). */
 static void LJ_FASTCALL recff_nyi(jit_State *J, RecordFFData *rd)
 {
+  if (recff_stitch(J)) {
+    rd->nres = -1;
+    return;
+  }
   setfuncV(J->L, &J->errinfo, J->fn);
   lj_trace_err_info(J, LJ_TRERR_NYIFF);
-  UNUSED(rd);
 }
 
 /* C functions can have arbitrary side-effects and are not recorded (yet). */
 static void LJ_FASTCALL recff_c(jit_State *J, RecordFFData *rd)
 {
+  if (recff_stitch(J)) {
+    rd->nres = -1;
+    return;
+  }
   setfuncV(J->L, &J->errinfo, J->fn);
   lj_trace_err_info(J, LJ_TRERR_NYICF);
-  UNUSED(rd);
 }
 
 /* -- Base library fast functions ----------------------------------------- */
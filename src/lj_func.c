@@ -14,6 +14,7 @@
 #include "lj_func.h"
 #include "lj_trace.h"
 #include "lj_vm.h"
+#include "lj_bcdump.h"
 
 /* -- Prototypes ---------------------------------------------------------- */
 
@@ -66,7 +67,7 @@ static GCupval *func_finduv(lua_State *L, TValue *slot)
 }
 
 /* Create an empty and closed upvalue. */
-static GCupval *func_emptyuv(lua_State *L)
+GCupval *lj_func_emptyuv(lua_State *L)
 {
   GCupval *uv = (GCupval *)lj_mem_newgco(L, sizeof(GCupval));
   uv->gct = ~LJ_TUPVAL;
@@ -139,7 +140,7 @@ GCfunc *lj_func_newL_empty(lua_State *L, GCproto *pt, GCtab *env)
   MSize i, nuv = pt->sizeuv;
   /* NOBARRIER: The GCfunc is new (marked white). */
   for (i = 0; i < nuv; i++) {
-    GCupval *uv = func_emptyuv(L);
+    GCupval *uv = lj_func_emptyuv(L);
     uv->dhash = (uint32_t)(uintptr_t)pt ^ ((uint32_t)proto_uv(pt)[i] << 24);
     setgcref(fn->l.uvptr[i], obj2gco(uv));
   }
@@ -155,6 +156,10 @@ GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent)
   MSize i, nuv;
   TValue *base;
   lj_gc_check_fixtop(L);
+  if (LJ_UNLIKELY(bclazy_isstub(pt))) {  /* Load prototype on demand. */
+    L->top = curr_topL(L);
+    pt = lj_bcread_lazy(L, funcproto((GCfunc *)parent), pt);
+  }
   fn = func_newL(L, pt, tabref(parent->env));
   /* NOBARRIER: The GCfunc is new (marked white). */
   puv = parent->uvptr;
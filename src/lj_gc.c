@@ -331,7 +331,8 @@ static size_t propagatemark(global_State *g)
     GCtrace *T = gco2trace(o);
     gc_traverse_trace(g, T);
     return ((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
-	   T->nsnap*sizeof(SnapShot) + T->nsnapmap*sizeof(SnapEntry);
+	   T->nsnap*sizeof(SnapShot) +
+	   T->nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore));
 #else
     lua_assert(0);
     return 0;
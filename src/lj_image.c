@@ -0,0 +1,1185 @@
+/*
+** Heap image snapshot and restore.
+** Copyright (C) 2005-2014 Mike Pall. See Copyright Notice in luajit.h
+*/
+
+#define lj_image_c
+#define LUA_CORE
+
+#include "lua.h"
+#include "luajit.h"
+
+#include "lj_obj.h"
+#include "lj_gc.h"
+#include "lj_err.h"
+#include "lj_str.h"
+#include "lj_tab.h"
+#include "lj_func.h"
+#include "lj_state.h"
+#if LJ_HASFFI
+#include "lj_ctype.h"
+#include "lj_cdata.h"
+#endif
+#include "lj_ff.h"
+#include "lj_lex.h"
+#include "lj_bcdump.h"
+#include "lj_vm.h"
+
+/* -- Image format -------------------------------------------------------- */
+
+/*
+** An image holds the object graph reachable from the registry, the
+** globals, the base metatables and the FFI metatype map. It's only valid
+** for the binary that created it:
+**
+** image   = header ctypes dumps objects names fills
+** header  = 0x1b 'L' 'J' 'I' version flags ffmax
+** ctypes  = N (info size sib hashed namelen+1 name)*N   (N = 0 w/o FFI)
+** dumps   = N (len bytecode-dump)*N
+** objects = N (kind payload)*N
+** names   = N (id gct n (parent key)*n)*N
+** fills   = N (id fill)*N
+**
+** Objects are numbered from 1 in order. Tables, functions and upvalues
+** are created first and filled in later, so references may form cycles.
+** Prototypes are numbered in depth-first order over all dumps.
+**
+** Objects that exist in every state aren't stored, but resolved against
+** the restoring state: roots by number, builtin functions by their fast
+** function ID and tables by their parent table and key. Tables up to
+** IMG_MAXDEPTH levels below a root are named and merged into the existing
+** table, if any. Other C functions and userdata may be aliased by scripts,
+** so they keep up to IMG_MAXNAME names and are resolved by the first name
+** that exists in the restoring state, after all objects have been created.
+*/
+
+#define IMG_HEAD1	0x1b
+#define IMG_HEAD2	'L'
+#define IMG_HEAD3	'J'
+#define IMG_HEAD4	'I'
+#define IMG_VERSION	2
+
+#define IMG_F_BE	0x01
+#define IMG_F_64	0x02
+#define IMG_F_DUALNUM	0x04
+#define IMG_F_FFI	0x08
+
+#define IMG_F_HOST \
+  ((LJ_BE ? IMG_F_BE : 0) | (LJ_64 ? IMG_F_64 : 0) | \
+   (LJ_DUALNUM ? IMG_F_DUALNUM : 0) | (LJ_HASFFI ? IMG_F_FFI : 0))
+
+#define IMG_MAXDEPTH	3	/* Max. depth of named tables below a root. */
+#define IMG_MAXNAME	4	/* Max. names of a C function or userdata. */
+
+/* Object kinds. */
+enum {
+  IMG_STR, IMG_TAB, IMG_LFUNC, IMG_UPVAL, IMG_CDATA,
+  IMG_ROOT, IMG_PATH, IMG_FFID, IMG_NAME
+};
+
+/* Value tags. */
+enum {
+  IMG_VNIL, IMG_VFALSE, IMG_VTRUE, IMG_VINT, IMG_VNUM, IMG_VREF
+};
+
+/* Roots. */
+enum {
+  IMG_ROOT_REG, IMG_ROOT_ENV, IMG_ROOT_MISC, IMG_ROOT_BASEMT
+};
+
+#define IMG_ROOT_MAX	(IMG_ROOT_BASEMT+~LJ_TNUMX+1)
+
+/* -- Builtin functions --------------------------------------------------- */
+
+/* Map of fast function IDs to the first function found in a state. */
+typedef GCfunc *ImgFFMap[FF__MAX];
+
+static void img_ffmark(GCfunc **ffmap, GCfunc *fn)
+{
+  if (isffunc(fn) && !ffmap[fn->c.ffid]) {
+    MSize i;
+    ffmap[fn->c.ffid] = fn;
+    for (i = 0; i < fn->c.nupvalues; i++)  /* E.g. ipairs_aux. */
+      if (tvisfunc(&fn->c.upvalue[i]))
+	img_ffmark(ffmap, funcV(&fn->c.upvalue[i]));
+  }
+}
+
+static void img_ffscan(GCfunc **ffmap, GCtab *t, int depth)
+{
+  Node *node = noderef(t->node);
+  MSize i, hmask = t->hmask;
+  for (i = 0; i <= hmask + t->asize; i++) {
+    cTValue *o = i < t->asize ? arrayslot(t, i) : &node[i-t->asize].val;
+    if (tvisfunc(o))
+      img_ffmark(ffmap, funcV(o));
+    else if (tvistab(o) && depth > 0)
+      img_ffscan(ffmap, tabV(o), depth-1);
+  }
+}
+
+/* Find the builtin functions in the library tables. */
+static void img_ffinit(lua_State *L, GCfunc **ffmap)
+{
+  global_State *g = G(L);
+  MSize i;
+  memset(ffmap, 0, sizeof(ImgFFMap));
+  img_ffscan(ffmap, tabV(registry(L)), 2);
+  img_ffscan(ffmap, tabref(L->env), 1);
+  for (i = 0; i <= ~LJ_TNUMX; i++)
+    if (gcref(g->gcroot[GCROOT_BASEMT+i]))
+      img_ffscan(ffmap, gco2tab(gcref(g->gcroot[GCROOT_BASEMT+i])), 1);
+#if LJ_HASFFI
+  if (ctype_ctsG(g))
+    img_ffscan(ffmap, ctype_ctsG(g)->miscmap, 1);
+#endif
+}
+
+/* Get root table. Returns NULL if missing. */
+static GCtab *img_root(lua_State *L, uint32_t r)
+{
+  global_State *g = G(L);
+  if (r == IMG_ROOT_REG) {
+    return tabV(registry(L));
+  } else if (r == IMG_ROOT_ENV) {
+    return tabref(L->env);
+  } else if (r == IMG_ROOT_MISC) {
+#if LJ_HASFFI
+    if (ctype_ctsG(g)) return ctype_ctsG(g)->miscmap;
+#endif
+    return NULL;
+  } else {
+    GCobj *o = gcref(g->gcroot[GCROOT_BASEMT+r-IMG_ROOT_BASEMT]);
+    return o ? gco2tab(o) : NULL;
+  }
+}
+
+/* Callback slots in the FFI metatype map are not part of an image. */
+#define img_skipkey(r, key) \
+  ((r) == IMG_ROOT_MISC && tvisnumber((key)) && numberVnum((key)) >= 0)
+
+/* Iterate over the prototypes of a dump in depth-first order. */
+typedef void (*ImgPtFunc)(void *ctx, GCproto *pt);
+
+static void img_ptwalk(GCproto *pt, ImgPtFunc f, void *ctx)
+{
+  GCRef *kr = mref(pt->k, GCRef) - (ptrdiff_t)pt->sizekgc;
+  MSize i;
+  f(ctx, pt);
+  for (i = 0; i < pt->sizekgc; i++, kr++)
+    if (gcref(*kr)->gch.gct == ~LJ_TPROTO)
+      img_ptwalk(gco2pt(gcref(*kr)), f, ctx);
+}
+
+/* -- Snapshot ------------------------------------------------------------ */
+
+/* Object to be saved. */
+typedef struct ImgObj {
+  GCobj *o;		/* Object. */
+  TValue key;		/* IMG_PATH, IMG_NAME: key in parent table. */
+  uint32_t parent;	/* IMG_PATH, IMG_NAME: ID of parent. IMG_ROOT: root. */
+  uint32_t alias;	/* IMG_NAME: index of first alias or 0. */
+  uint8_t kind;		/* Object kind. */
+  uint8_t depth;	/* Depth of named tables below a root. */
+} ImgObj;
+
+/* Other name of a C function or userdata. */
+typedef struct ImgAlias {
+  TValue key;		/* Key in parent table. */
+  uint32_t parent;	/* ID of parent table. */
+  uint32_t next;	/* Index of next alias or 0. */
+} ImgAlias;
+
+/* Context for snapshot. */
+typedef struct ImgSaveCtx {
+  SBuf sb;		/* Output buffer. */
+  SBuf tmp;		/* Buffer for bytecode dumps. */
+  lua_State *L;		/* Lua state. */
+  ImgObj *obj;		/* Objects, indexed by ID. */
+  MSize nobj;		/* Number of objects. */
+  MSize sizeobj;	/* Size of object vector. */
+  ImgAlias *alias;	/* Aliases, indexed from 1. */
+  MSize nalias;		/* Number of aliases. */
+  MSize sizealias;	/* Size of alias vector. */
+  GCproto **pt;		/* Prototypes of Lua functions. */
+  MSize npt;		/* Number of prototypes. */
+  MSize sizept;		/* Size of prototype vector. */
+  GCtab *ids;		/* Map of objects to IDs and prototypes to numbers. */
+  uint32_t ptnum;	/* Prototype number. */
+  lua_Writer wfunc;	/* Writer callback. */
+  void *wdata;		/* Writer callback data. */
+  int status;		/* Status from writer callback. */
+  ImgFFMap ffmap;	/* Builtin functions. */
+} ImgSaveCtx;
+
+/* Need a certain amount of buffer space. */
+static LJ_AINLINE char *img_need(ImgSaveCtx *ctx, MSize len)
+{
+  if (LJ_UNLIKELY(ctx->sb.n + len > ctx->sb.sz)) {
+    MSize sz = ctx->sb.sz * 2;
+    if (sz < ctx->sb.n + len) sz = ctx->sb.n + len;
+    lj_str_needbuf(ctx->L, &ctx->sb, sz);
+  }
+  return ctx->sb.buf + ctx->sb.n;
+}
+
+static void img_putb(ImgSaveCtx *ctx, int b)
+{
+  *img_need(ctx, 1) = (char)b;
+  ctx->sb.n++;
+}
+
+static void img_putu(ImgSaveCtx *ctx, uint32_t v)
+{
+  uint8_t *p = (uint8_t *)img_need(ctx, 5);
+  MSize n = 0;
+  for (; v >= 0x80; v >>= 7)
+    p[n++] = (uint8_t)((v & 0x7f) | 0x80);
+  p[n++] = (uint8_t)v;
+  ctx->sb.n += n;
+}
+
+static void img_putmem(ImgSaveCtx *ctx, const void *p, MSize len)
+{
+  memcpy(img_need(ctx, len), p, len);
+  ctx->sb.n += len;
+}
+
+/* Get ID of object or prototype number. Returns 0 if unknown. */
+static uint32_t img_id(ImgSaveCtx *ctx, cTValue *o)
+{
+  cTValue *tv = lj_tab_get(ctx->L, ctx->ids, o);
+  if (tvisint(tv)) return (uint32_t)intV(tv);
+  return tvisnum(tv) ? (uint32_t)lj_num2int(numV(tv)) : 0;
+}
+
+static void img_setid(ImgSaveCtx *ctx, cTValue *o, uint32_t id)
+{
+  TValue *tv = lj_tab_set(ctx->L, ctx->ids, o);
+  setintV(tv, (int32_t)id);
+}
+
+static void img_putv(ImgSaveCtx *ctx, cTValue *o)
+{
+  if (tvisnil(o)) {
+    img_putb(ctx, IMG_VNIL);
+  } else if (tvisbool(o)) {
+    img_putb(ctx, tvistrue(o) ? IMG_VTRUE : IMG_VFALSE);
+  } else if (tvisint(o)) {
+    img_putb(ctx, IMG_VINT);
+    img_putu(ctx, (uint32_t)intV(o));
+  } else if (tvisnum(o)) {
+    lua_Number n = numV(o);
+    int32_t k = lj_num2int(n);
+    if (n == (lua_Number)k && !(k == 0 && o->u32.hi)) {
+      img_putb(ctx, IMG_VINT);
+      img_putu(ctx, (uint32_t)k);
+    } else {
+      img_putb(ctx, IMG_VNUM);
+      img_putmem(ctx, o, 8);
+    }
+  } else {
+    uint32_t id = img_id(ctx, o);
+    lua_assert(id != 0);
+    img_putb(ctx, IMG_VREF);
+    img_putu(ctx, id);
+  }
+}
+
+/* Check whether a C type can be saved, i.e. holds no pointers. */
+#if LJ_HASFFI
+static int img_ctypeok(CTState *cts, CTypeID id)
+{
+  CType *ct = ctype_raw(cts, id);
+  if (ctype_isnum(ct->info) || ctype_isenum(ct->info)) {
+    return 1;
+  } else if (ctype_isarray(ct->info)) {
+    return img_ctypeok(cts, ctype_cid(ct->info));
+  } else if (ctype_isstruct(ct->info)) {
+    CTypeID sib = ct->sib;
+    while (sib) {
+      CType *f = ctype_get(cts, sib);
+      if (ctype_isfield(f->info) && !img_ctypeok(cts, ctype_cid(f->info)))
+	return 0;
+      sib = f->sib;
+    }
+    return 1;
+  }
+  return 0;
+}
+#endif
+
+static LJ_NORET LJ_NOINLINE void img_errobj(lua_State *L, const char *what)
+{
+  lj_str_pushf(L, err2msg(LJ_ERR_IMGOBJ), what);
+  lj_err_throw(L, LUA_ERRRUN);
+}
+
+/* Add another name of a C function or userdata. */
+static void img_alias(ImgSaveCtx *ctx, uint32_t id, uint32_t parent,
+		      cTValue *key)
+{
+  uint32_t a, last = 0;
+  MSize n = 1;
+  for (a = ctx->obj[id].alias; a; last = a, a = ctx->alias[a].next)
+    if (++n >= IMG_MAXNAME) return;
+  if (ctx->nalias+1 >= ctx->sizealias)
+    lj_mem_growvec(ctx->L, ctx->alias, ctx->sizealias, LJ_MAX_ASIZE, ImgAlias);
+  a = ++ctx->nalias;
+  ctx->alias[a].parent = parent;
+  copyTV(ctx->L, &ctx->alias[a].key, key);
+  ctx->alias[a].next = 0;
+  if (last)
+    ctx->alias[last].next = a;
+  else
+    ctx->obj[id].alias = a;
+}
+
+/* Add object, unless it's already known. */
+static void img_visit(ImgSaveCtx *ctx, cTValue *o, uint32_t parent,
+		      cTValue *key)
+{
+  lua_State *L = ctx->L;
+  ImgObj *ob;
+  uint32_t id;
+  int kind, named = 0;
+  if (!tvisgcv(o)) {
+    if (tvislightud(o)) img_errobj(L, "light userdata");
+    return;
+  }
+  if (parent && ctx->obj[parent].kind >= IMG_ROOT &&
+      ctx->obj[parent].depth < IMG_MAXDEPTH &&
+      (tvisstr(key) || tvisnumber(key)))
+    named = 1;
+  if ((id = img_id(ctx, o))) {
+    if (named && ctx->obj[id].kind == IMG_NAME)
+      img_alias(ctx, id, parent, key);
+    return;
+  }
+  if (tvisstr(o)) {
+    kind = IMG_STR;
+  } else if (tvistab(o)) {
+    kind = named ? IMG_PATH : IMG_TAB;
+  } else if (tvisfunc(o)) {
+    GCfunc *fn = funcV(o);
+    if (isluafunc(fn))
+      kind = IMG_LFUNC;
+    else if (isffunc(fn) && ctx->ffmap[fn->c.ffid] == fn)
+      kind = IMG_FFID;
+    else if (named)
+      kind = IMG_NAME;
+    else
+      img_errobj(L, "C function");
+  } else if (tvisudata(o)) {
+    if (!named) img_errobj(L, "userdata");
+    kind = IMG_NAME;
+#if LJ_HASFFI
+  } else if (tviscdata(o)) {
+    GCcdata *cd = cdataV(o);
+    if ((cd->marked & LJ_GC_CDATA_FIN) ||
+	!img_ctypeok(ctype_ctsG(G(L)), cd->ctypeid))
+      img_errobj(L, "cdata with pointers or finalizer");
+    kind = IMG_CDATA;
+#endif
+  } else if (itype(o) == LJ_TUPVAL) {
+    kind = IMG_UPVAL;
+  } else {
+    img_errobj(L, lj_typename(o));
+  }
+  if (ctx->nobj+1 >= ctx->sizeobj)
+    lj_mem_growvec(L, ctx->obj, ctx->sizeobj, LJ_MAX_ASIZE, ImgObj);
+  ob = &ctx->obj[++ctx->nobj];
+  ob->o = gcV(o);
+  ob->kind = (uint8_t)kind;
+  ob->depth = 0;
+  ob->alias = 0;
+  if (kind == IMG_PATH || kind == IMG_NAME) {
+    ob->parent = parent;
+    copyTV(L, &ob->key, key);
+    ob->depth = (uint8_t)(ctx->obj[parent].depth + 1);
+  }
+  img_setid(ctx, o, ctx->nobj);
+}
+
+static void img_addroot(ImgSaveCtx *ctx, uint32_t r)
+{
+  GCtab *t = img_root(ctx->L, r);
+  TValue tv;
+  if (t) {
+    settabV(ctx->L, &tv, t);
+    if (!img_id(ctx, &tv)) {
+      img_visit(ctx, &tv, 0, NULL);
+      ctx->obj[ctx->nobj].kind = IMG_ROOT;
+      ctx->obj[ctx->nobj].parent = r;
+    }
+  }
+}
+
+/* Add everything referenced by an object. */
+static void img_trace(ImgSaveCtx *ctx, uint32_t id)
+{
+  lua_State *L = ctx->L;
+  GCobj *o = ctx->obj[id].o;
+  TValue tv;
+  if (o->gch.gct == ~LJ_TTAB) {
+    GCtab *t = gco2tab(o);
+    Node *node = noderef(t->node);
+    uint32_t r = ctx->obj[id].kind == IMG_ROOT ? ctx->obj[id].parent : ~0u;
+    MSize i, hmask = t->hmask;
+    if (tabref(t->metatable)) {
+      settabV(L, &tv, tabref(t->metatable));
+      img_visit(ctx, &tv, 0, NULL);
+    }
+    for (i = 0; i < t->asize; i++) {
+      setintV(&tv, (int32_t)i);
+      if (!img_skipkey(r, &tv))
+	img_visit(ctx, arrayslot(t, i), id, &tv);
+    }
+    for (i = 0; i <= hmask; i++) {
+      Node *n = &node[i];
+      if (!tvisnil(&n->val) && !img_skipkey(r, &n->key)) {
+	img_visit(ctx, &n->key, 0, NULL);
+	img_visit(ctx, &n->val, id, &n->key);
+      }
+    }
+  } else if (o->gch.gct == ~LJ_TFUNC && isluafunc(&o->fn)) {
+    GCfunc *fn = &o->fn;
+    GCproto *pt = funcproto(fn);
+    MSize i;
+    settabV(L, &tv, tabref(fn->l.env));
+    img_visit(ctx, &tv, 0, NULL);
+    for (i = 0; i < fn->l.nupvalues; i++) {
+      setgcV(L, &tv, gcref(fn->l.uvptr[i]), LJ_TUPVAL);
+      img_visit(ctx, &tv, 0, NULL);
+    }
+    setprotoV(L, &tv, pt);
+    if (!img_id(ctx, &tv)) {
+      if (ctx->npt >= ctx->sizept)
+	lj_mem_growvec(L, ctx->pt, ctx->sizept, LJ_MAX_ASIZE, GCproto *);
+      ctx->pt[ctx->npt++] = pt;
+      setboolV(lj_tab_set(L, ctx->ids, &tv), 1);
+    }
+  } else if (o->gch.gct == ~LJ_TUPVAL) {
+    img_visit(ctx, uvval(&o->uv), 0, NULL);
+  }
+}
+
+/* Mark all children of a prototype as not being the root of a dump. */
+static void img_ptchild(ImgSaveCtx *ctx, GCproto *pt)
+{
+  GCRef *kr = mref(pt->k, GCRef) - (ptrdiff_t)pt->sizekgc;
+  MSize i;
+  for (i = 0; i < pt->sizekgc; i++, kr++)
+    if (gcref(*kr)->gch.gct == ~LJ_TPROTO) {
+      TValue tv, *o;
+      setprotoV(ctx->L, &tv, gco2pt(gcref(*kr)));
+      o = lj_tab_set(ctx->L, ctx->ids, &tv);
+      if (!tvisfalse(o)) {
+	setboolV(o, 0);
+	img_ptchild(ctx, gco2pt(gcref(*kr)));
+      }
+    }
+}
+
+static void img_ptnum(void *ud, GCproto *pt)
+{
+  ImgSaveCtx *ctx = (ImgSaveCtx *)ud;
+  TValue tv;
+  setprotoV(ctx->L, &tv, pt);
+  img_setid(ctx, &tv, ++ctx->ptnum);
+}
+
+static int img_dumpwriter(lua_State *L, const void *p, size_t sz, void *ud)
+{
+  SBuf *sb = (SBuf *)ud;
+  memcpy(lj_str_needbuf(L, sb, sb->n + (MSize)sz) + sb->n, p, sz);
+  sb->n += (MSize)sz;
+  return 0;
+}
+
+/* Write the minimal set of bytecode dumps covering all prototypes. */
+static void img_savedumps(ImgSaveCtx *ctx)
+{
+  lua_State *L = ctx->L;
+  MSize i, ndump = 0;
+  TValue tv;
+  for (i = 0; i < ctx->npt; i++)
+    img_ptchild(ctx, ctx->pt[i]);
+  for (i = 0; i < ctx->npt; i++) {
+    setprotoV(L, &tv, ctx->pt[i]);
+    if (tvistrue(lj_tab_get(L, ctx->ids, &tv))) ndump++;
+  }
+  img_putu(ctx, ndump);
+  for (i = 0; i < ctx->npt; i++) {
+    GCproto *pt = ctx->pt[i];
+    int status;
+    setprotoV(L, &tv, pt);
+    if (!tvistrue(lj_tab_get(L, ctx->ids, &tv))) continue;
+    lj_str_resetbuf(&ctx->tmp);
+    status = lj_bcwrite(L, pt, img_dumpwriter, &ctx->tmp, 0);
+    if (status) lj_err_throw(L, status);
+    img_putu(ctx, ctx->tmp.n);
+    img_putmem(ctx, ctx->tmp.buf, ctx->tmp.n);
+    img_ptwalk(pt, img_ptnum, ctx);  /* Stubs have been loaded by now. */
+  }
+}
+
+#if LJ_HASFFI
+static void img_savectypes(ImgSaveCtx *ctx)
+{
+  lua_State *L = ctx->L;
+  CTState *cts = ctype_ctsG(G(L));
+  CTypeID id;
+  uint8_t *hashed;
+  if (!cts) {
+    img_putu(ctx, 0);
+    return;
+  }
+  hashed = (uint8_t *)lj_str_needbuf(L, &G(L)->tmpbuf, cts->top);
+  memset(hashed, 0, cts->top);
+  for (id = 0; id < CTHASH_SIZE; id++) {
+    CTypeID h = cts->hash[id];
+    while (h) { hashed[h] = 1; h = ctype_get(cts, h)->next; }
+  }
+  img_putu(ctx, cts->top);
+  for (id = 0; id < cts->top; id++) {
+    CType *ct = &cts->tab[id];
+    GCstr *name = gcrefp(ct->name, GCstr);
+    img_putu(ctx, ct->info);
+    img_putu(ctx, ct->size);
+    img_putu(ctx, ct->sib);
+    img_putb(ctx, hashed[id]);
+    img_putu(ctx, name ? name->len+1 : 0);
+    if (name) img_putmem(ctx, strdata(name), name->len);
+  }
+}
+#endif
+
+/* Write object definition. */
+static void img_saveobj(ImgSaveCtx *ctx, ImgObj *ob)
+{
+  GCobj *o = ob->o;
+  img_putb(ctx, ob->kind);
+  switch (ob->kind) {
+  case IMG_STR:
+    img_putu(ctx, gco2str(o)->len);
+    img_putmem(ctx, strdata(gco2str(o)), gco2str(o)->len);
+    break;
+  case IMG_TAB: {
+    GCtab *t = gco2tab(o);
+    img_putu(ctx, t->asize);
+    img_putu(ctx, t->hmask ? hsize2hbits(t->hmask+1) : 0);
+    break;
+    }
+  case IMG_LFUNC: {
+    TValue tv;
+    setprotoV(ctx->L, &tv, funcproto(&o->fn));
+    img_putu(ctx, img_id(ctx, &tv));
+    break;
+    }
+  case IMG_UPVAL:
+    img_putb(ctx, o->uv.immutable);
+    img_putu(ctx, o->uv.dhash);
+    break;
+#if LJ_HASFFI
+  case IMG_CDATA: {
+    GCcdata *cd = gco2cd(o);
+    CTState *cts = ctype_ctsG(G(ctx->L));
+    MSize len = cdataisv(cd) ? cdatavlen(cd) : lj_ctype_size(cts, cd->ctypeid);
+    img_putu(ctx, cd->ctypeid);
+    img_putb(ctx, cdataisv(cd) ? 1 : 0);
+    img_putu(ctx, len);
+    img_putmem(ctx, cdataptr(cd), len);
+    break;
+    }
+#endif
+  case IMG_ROOT:
+    img_putu(ctx, ob->parent);
+    break;
+  case IMG_PATH:
+    img_putu(ctx, ob->parent);
+    img_putv(ctx, &ob->key);
+    img_putb(ctx, o->gch.gct);
+    break;
+  case IMG_FFID:
+    img_putu(ctx, o->fn.c.ffid);
+    break;
+  case IMG_NAME:  /* Resolved later, see img_savenames. */
+    break;
+  default: lua_assert(0); break;
+  }
+}
+
+/* Write the names of all C functions and userdata. */
+static void img_savenames(ImgSaveCtx *ctx)
+{
+  uint32_t i, n = 0;
+  for (i = 1; i <= ctx->nobj; i++)
+    n += (ctx->obj[i].kind == IMG_NAME);
+  img_putu(ctx, n);
+  for (i = 1; i <= ctx->nobj; i++) {
+    ImgObj *ob = &ctx->obj[i];
+    if (ob->kind == IMG_NAME) {
+      uint32_t a;
+      img_putu(ctx, i);
+      img_putb(ctx, ob->o->gch.gct);
+      for (n = 1, a = ob->alias; a; a = ctx->alias[a].next) n++;
+      img_putu(ctx, n);
+      img_putu(ctx, ob->parent);
+      img_putv(ctx, &ob->key);
+      for (a = ob->alias; a; a = ctx->alias[a].next) {
+	img_putu(ctx, ctx->alias[a].parent);
+	img_putv(ctx, &ctx->alias[a].key);
+      }
+    }
+  }
+}
+
+/* Write contents of a table, Lua function or upvalue. */
+static void img_savefill(ImgSaveCtx *ctx, uint32_t id)
+{
+  lua_State *L = ctx->L;
+  GCobj *o = ctx->obj[id].o;
+  TValue tv;
+  img_putu(ctx, id);
+  if (o->gch.gct == ~LJ_TTAB) {
+    GCtab *t = gco2tab(o);
+    Node *node = noderef(t->node);
+    uint32_t r = ctx->obj[id].kind == IMG_ROOT ? ctx->obj[id].parent : ~0u;
+    MSize i, hmask = t->hmask, n = 0;
+    if (tabref(t->metatable))
+      settabV(L, &tv, tabref(t->metatable));
+    else
+      setnilV(&tv);
+    img_putv(ctx, &tv);
+    for (i = 0; i < t->asize; i++)
+      if (!tvisnil(arrayslot(t, i))) n++;
+    for (i = 0; i <= hmask; i++)
+      if (!tvisnil(&node[i].val) && !img_skipkey(r, &node[i].key)) n++;
+    img_putu(ctx, n);
+    for (i = 0; i < t->asize; i++)
+      if (!tvisnil(arrayslot(t, i))) {
+	setintV(&tv, (int32_t)i);
+	img_putv(ctx, &tv);
+	img_putv(ctx, arrayslot(t, i));
+      }
+    for (i = 0; i <= hmask; i++) {
+      Node *nd = &node[i];
+      if (!tvisnil(&nd->val) && !img_skipkey(r, &nd->key)) {
+	img_putv(ctx, &nd->key);
+	img_putv(ctx, &nd->val);
+      }
+    }
+  } else if (o->gch.gct == ~LJ_TFUNC) {
+    GCfunc *fn = &o->fn;
+    MSize i;
+    settabV(L, &tv, tabref(fn->l.env));
+    img_putv(ctx, &tv);
+    for (i = 0; i < fn->l.nupvalues; i++) {
+      setgcV(L, &tv, gcref(fn->l.uvptr[i]), LJ_TUPVAL);
+      img_putu(ctx, img_id(ctx, &tv));
+    }
+  } else {
+    img_putv(ctx, uvval(&o->uv));
+  }
+}
+
+static int img_hasfill(ImgObj *ob)
+{
+  return ob->kind == IMG_TAB || ob->kind == IMG_ROOT ||
+	 ob->kind == IMG_LFUNC || ob->kind == IMG_UPVAL ||
+	 ob->kind == IMG_PATH;
+}
+
+static TValue *cpimgsave(lua_State *L, lua_CFunction dummy, void *ud)
+{
+  ImgSaveCtx *ctx = (ImgSaveCtx *)ud;
+  char *p;
+  uint32_t i, nfill = 0;
+  UNUSED(dummy);
+  ctx->ids = lj_tab_new(L, 0, 0);
+  settabV(L, L->top, ctx->ids);
+  incr_top(L);
+  img_ffinit(L, ctx->ffmap);
+  for (i = 0; i < IMG_ROOT_MAX; i++)
+    img_addroot(ctx, i);
+  for (i = 1; i <= ctx->nobj; i++)  /* Breadth-first, so names are short. */
+    img_trace(ctx, i);
+  lj_str_resizebuf(L, &ctx->sb, 1024);
+  p = img_need(ctx, 5);
+  p[0] = IMG_HEAD1; p[1] = IMG_HEAD2; p[2] = IMG_HEAD3; p[3] = IMG_HEAD4;
+  p[4] = IMG_VERSION;
+  ctx->sb.n += 5;
+  img_putb(ctx, IMG_F_HOST);
+  img_putu(ctx, FF__MAX);
+#if LJ_HASFFI
+  img_savectypes(ctx);
+#else
+  img_putu(ctx, 0);
+#endif
+  img_savedumps(ctx);
+  img_putu(ctx, ctx->nobj);
+  for (i = 1; i <= ctx->nobj; i++) {
+    img_saveobj(ctx, &ctx->obj[i]);
+    nfill += img_hasfill(&ctx->obj[i]);
+  }
+  img_savenames(ctx);
+  img_putu(ctx, nfill);
+  for (i = 1; i <= ctx->nobj; i++)
+    if (img_hasfill(&ctx->obj[i]))
+      img_savefill(ctx, i);
+  ctx->status = ctx->wfunc(L, ctx->sb.buf, ctx->sb.n, ctx->wdata);
+  L->top--;
+  return NULL;
+}
+
+/* Snapshot the state. */
+LUA_API int luaJIT_saveimage(lua_State *L, lua_Writer writer, void *data)
+{
+  ImgSaveCtx ctx;
+  int status;
+  ctx.L = L;
+  ctx.obj = NULL;
+  ctx.nobj = ctx.sizeobj = 0;
+  ctx.alias = NULL;
+  ctx.nalias = ctx.sizealias = 0;
+  ctx.pt = NULL;
+  ctx.npt = ctx.sizept = 0;
+  ctx.ptnum = 0;
+  ctx.wfunc = writer;
+  ctx.wdata = data;
+  ctx.status = 0;
+  lj_str_initbuf(&ctx.sb);
+  lj_str_resetbuf(&ctx.sb);
+  lj_str_initbuf(&ctx.tmp);
+  lj_str_resetbuf(&ctx.tmp);
+  status = lj_vm_cpcall(L, NULL, &ctx, cpimgsave);
+  if (status == 0) status = ctx.status;
+  lj_str_freebuf(G(L), &ctx.sb);
+  lj_str_freebuf(G(L), &ctx.tmp);
+  lj_mem_freevec(G(L), ctx.obj, ctx.sizeobj, ImgObj);
+  lj_mem_freevec(G(L), ctx.alias, ctx.sizealias, ImgAlias);
+  lj_mem_freevec(G(L), ctx.pt, ctx.sizept, GCproto *);
+  return status;
+}
+
+/* -- Restore ------------------------------------------------------------- */
+
+/* Context for restore. */
+typedef struct ImgLoadCtx {
+  lua_State *L;		/* Lua state. */
+  const uint8_t *p;	/* Current position in image. */
+  const uint8_t *pe;	/* End of image. */
+  GCtab *objs;		/* Objects, indexed by ID. */
+  GCtab *pts;		/* Prototypes, indexed by number. */
+  uint32_t nobj;	/* Number of objects. */
+  uint32_t npt;		/* Number of prototypes. */
+  ImgFFMap ffmap;	/* Builtin functions. */
+} ImgLoadCtx;
+
+static LJ_NORET LJ_NOINLINE void img_errbad(ImgLoadCtx *ctx)
+{
+  lj_err_msg(ctx->L, LJ_ERR_IMGBAD);
+}
+
+static LJ_NORET LJ_NOINLINE void img_errref(lua_State *L, cTValue *key)
+{
+  lj_str_pushf(L, err2msg(LJ_ERR_IMGREF),
+	       tvisstr(key) ? strVdata(key) : "?");
+  lj_err_throw(L, LUA_ERRRUN);
+}
+
+static LJ_AINLINE const uint8_t *img_mem(ImgLoadCtx *ctx, MSize len)
+{
+  const uint8_t *p = ctx->p;
+  if (LJ_UNLIKELY((MSize)(ctx->pe - p) < len)) img_errbad(ctx);
+  ctx->p = p + len;
+  return p;
+}
+
+static uint32_t img_getb(ImgLoadCtx *ctx)
+{
+  return *img_mem(ctx, 1);
+}
+
+static uint32_t img_getu(ImgLoadCtx *ctx)
+{
+  uint32_t v = 0;
+  int sh = 0;
+  for (;;) {
+    uint32_t b = img_getb(ctx);
+    v |= (b & 0x7f) << sh;
+    if (b < 0x80) return v;
+    if ((sh += 7) > 28) img_errbad(ctx);
+  }
+}
+
+static void img_getv(ImgLoadCtx *ctx, TValue *o)
+{
+  switch (img_getb(ctx)) {
+  case IMG_VNIL: setnilV(o); break;
+  case IMG_VFALSE: setboolV(o, 0); break;
+  case IMG_VTRUE: setboolV(o, 1); break;
+  case IMG_VINT: setintV(o, (int32_t)img_getu(ctx)); break;
+  case IMG_VNUM: memcpy(o, img_mem(ctx, 8), 8); break;
+  case IMG_VREF: {
+    uint32_t id = img_getu(ctx);
+    if (id == 0 || id > ctx->nobj) img_errbad(ctx);
+    copyTV(ctx->L, o, arrayslot(ctx->objs, id));
+    if (tvisnil(o)) img_errbad(ctx);
+    break;
+    }
+  default: img_errbad(ctx); break;
+  }
+}
+
+/* Get a previously defined table. */
+static GCtab *img_gettab(ImgLoadCtx *ctx, uint32_t id)
+{
+  cTValue *o;
+  if (id == 0 || id > ctx->nobj) img_errbad(ctx);
+  o = arrayslot(ctx->objs, id);
+  if (!tvistab(o)) img_errbad(ctx);
+  return tabV(o);
+}
+
+static void img_loadhead(ImgLoadCtx *ctx)
+{
+  const uint8_t *p = img_mem(ctx, 6);
+  if (p[0] != IMG_HEAD1 || p[1] != IMG_HEAD2 || p[2] != IMG_HEAD3 ||
+      p[3] != IMG_HEAD4 || p[4] != IMG_VERSION || p[5] != IMG_F_HOST ||
+      img_getu(ctx) != FF__MAX)
+    lj_err_msg(ctx->L, LJ_ERR_IMGFMT);
+}
+
+static void img_loadctypes(ImgLoadCtx *ctx)
+{
+  lua_State *L = ctx->L;
+  uint32_t n = img_getu(ctx);
+#if LJ_HASFFI
+  CTState *cts = ctype_ctsG(G(L));
+  CTypeID id;
+  if (n == 0) return;
+  if (!cts) {
+    TValue tv;
+    setstrV(L, &tv, lj_str_newlit(L, "ffi"));
+    img_errref(L, &tv);
+  }
+  if (n < cts->top || n > CTID_MAX) lj_err_msg(L, LJ_ERR_IMGFMT);
+  while (cts->sizetab < n)
+    lj_mem_growvec(L, cts->tab, cts->sizetab, CTID_MAX, CType);
+  for (id = 0; id < n; id++) {
+    CTInfo info = img_getu(ctx);
+    CTSize size = img_getu(ctx);
+    CTypeID sib = img_getu(ctx);
+    uint32_t hashed = img_getb(ctx);
+    MSize len = img_getu(ctx);
+    GCstr *name = NULL;
+    CType *ct = &cts->tab[id];
+    if (len) name = lj_str_new(L, (const char *)img_mem(ctx, len-1), len-1);
+    if (sib >= n) img_errbad(ctx);
+    if (id < cts->top) {  /* Must match the types already defined. */
+      if (ct->info != info || ct->size != size || ct->sib != sib ||
+	  gcrefp(ct->name, GCstr) != name)
+	lj_err_msg(L, LJ_ERR_IMGFMT);
+    } else {
+      ct->info = info;
+      ct->size = size;
+      ct->sib = (CTypeID1)sib;
+      ct->next = 0;
+      if (name) ctype_setname(ct, name); else setgcrefnull(ct->name);
+      cts->top = id+1;
+      if (hashed) {
+	if (name) lj_ctype_addname(cts, ct, id);
+	else lj_ctype_addtype(cts, ct, id);
+      }
+    }
+  }
+#else
+  UNUSED(L);
+  if (n) img_errbad(ctx);
+#endif
+}
+
+static void img_ptadd(void *ud, GCproto *pt)
+{
+  ImgLoadCtx *ctx = (ImgLoadCtx *)ud;
+  int32_t n = (int32_t)++ctx->npt;
+  setprotoV(ctx->L, lj_tab_setint(ctx->L, ctx->pts, n), pt);
+  lj_gc_anybarriert(ctx->L, ctx->pts);
+}
+
+typedef struct ImgReaderCtx {
+  const char *p;
+  size_t size;
+} ImgReaderCtx;
+
+static const char *img_reader(lua_State *L, void *ud, size_t *size)
+{
+  ImgReaderCtx *ctx = (ImgReaderCtx *)ud;
+  UNUSED(L);
+  if (ctx->size == 0) return NULL;
+  *size = ctx->size;
+  ctx->size = 0;
+  return ctx->p;
+}
+
+static void img_loaddumps(ImgLoadCtx *ctx)
+{
+  lua_State *L = ctx->L;
+  uint32_t i, n = img_getu(ctx);
+  for (i = 0; i < n; i++) {
+    ImgReaderCtx rd;
+    int status;
+    rd.size = img_getu(ctx);
+    rd.p = (const char *)img_mem(ctx, (MSize)rd.size);
+    status = lua_loadx(L, img_reader, &rd, NULL, "b");
+    if (status) lj_err_throw(L, status);
+    img_ptwalk(funcproto(funcV(L->top-1)), img_ptadd, ctx);
+    L->top--;
+  }
+}
+
+/* Create or resolve an object. */
+static void img_loadobj(ImgLoadCtx *ctx, TValue *o)
+{
+  lua_State *L = ctx->L;
+  switch (img_getb(ctx)) {
+  case IMG_STR: {
+    MSize len = img_getu(ctx);
+    setstrV(L, o, lj_str_new(L, (const char *)img_mem(ctx, len), len));
+    break;
+    }
+  case IMG_TAB: {
+    uint32_t asize = img_getu(ctx);
+    uint32_t hbits = img_getu(ctx);
+    if (asize > LJ_MAX_ASIZE || hbits > LJ_MAX_HBITS) img_errbad(ctx);
+    settabV(L, o, lj_tab_new(L, asize, hbits));
+    break;
+    }
+  case IMG_LFUNC: {
+    uint32_t n = img_getu(ctx);
+    cTValue *tv = n <= ctx->npt ? lj_tab_getint(ctx->pts, (int32_t)n) : NULL;
+    if (!tv || !tvisproto(tv)) img_errbad(ctx);
+    setfuncV(L, o, lj_func_newL_empty(L, protoV(tv), tabref(L->env)));
+    break;
+    }
+  case IMG_UPVAL: {
+    GCupval *uv = lj_func_emptyuv(L);
+    uv->immutable = (uint8_t)img_getb(ctx);
+    uv->dhash = img_getu(ctx);
+    setgcV(L, o, obj2gco(uv), LJ_TUPVAL);
+    break;
+    }
+#if LJ_HASFFI
+  case IMG_CDATA: {
+    CTypeID id = img_getu(ctx);
+    uint32_t isv = img_getb(ctx);
+    MSize len = img_getu(ctx);
+    CTState *cts = ctype_ctsG(G(L));
+    GCcdata *cd;
+    CTSize sz;
+    CTInfo info;
+    if (!cts || id >= cts->top) img_errbad(ctx);
+    cts->L = L;
+    info = lj_ctype_info(cts, id, &sz);
+    if (isv)
+      cd = lj_cdata_newv(cts, id, len, ctype_align(info));
+    else if (len == sz)
+      cd = lj_cdata_new(cts, id, len);
+    else
+      img_errbad(ctx);
+    memcpy(cdataptr(cd), img_mem(ctx, len), len);
+    setcdataV(L, o, cd);
+    break;
+    }
+#endif
+  case IMG_ROOT: {
+    uint32_t r = img_getu(ctx);
+    GCtab *t;
+    if (r >= IMG_ROOT_MAX) img_errbad(ctx);
+    t = img_root(L, r);
+    if (!t) {
+      if (r < IMG_ROOT_BASEMT) img_errbad(ctx);
+      t = lj_tab_new(L, 0, 0);
+      /* NOBARRIER: basemt is a GC root. */
+      setgcref(G(L)->gcroot[GCROOT_BASEMT+r-IMG_ROOT_BASEMT], obj2gco(t));
+    }
+    settabV(L, o, t);
+    break;
+    }
+  case IMG_PATH: {
+    GCtab *t = img_gettab(ctx, img_getu(ctx));
+    TValue key;
+    cTValue *tv;
+    uint32_t gct;
+    img_getv(ctx, &key);
+    gct = img_getb(ctx);
+    tv = lj_tab_get(L, t, &key);
+    if (tvisnil(tv) && gct == ~LJ_TTAB) {  /* Create missing table. */
+      GCtab *nt = lj_tab_new(L, 0, 0);
+      settabV(L, lj_tab_set(L, t, &key), nt);
+      lj_gc_anybarriert(L, t);
+      settabV(L, o, nt);
+    } else if (tvisgcv(tv) && gcV(tv)->gch.gct == gct) {
+      copyTV(L, o, tv);
+    } else {
+      img_errref(L, &key);
+    }
+    break;
+    }
+  case IMG_NAME:  /* Resolved later, see img_loadnames. */
+    setnilV(o);
+    break;
+  case IMG_FFID: {
+    uint32_t ffid = img_getu(ctx);
+    if (ffid >= FF__MAX || !ctx->ffmap[ffid]) {
+      TValue tv;
+      setstrV(L, &tv, lj_str_newlit(L, "builtin function"));
+      img_errref(L, &tv);
+    }
+    setfuncV(L, o, ctx->ffmap[ffid]);
+    break;
+    }
+  default:
+    img_errbad(ctx);
+    break;
+  }
+}
+
+/* Resolve C functions and userdata by the first name that exists. */
+static void img_loadnames(ImgLoadCtx *ctx)
+{
+  lua_State *L = ctx->L;
+  uint32_t i, n = img_getu(ctx);
+  for (i = 0; i < n; i++) {
+    uint32_t id = img_getu(ctx);
+    uint32_t gct = img_getb(ctx);
+    uint32_t j, nname = img_getu(ctx);
+    TValue *o, key, first;
+    if (id == 0 || id > ctx->nobj || nname == 0) img_errbad(ctx);
+    o = arrayslot(ctx->objs, id);
+    if (!tvisnil(o)) img_errbad(ctx);
+    for (j = 0; j < nname; j++) {
+      GCtab *t = img_gettab(ctx, img_getu(ctx));
+      img_getv(ctx, &key);
+      if (j == 0) copyTV(L, &first, &key);
+      if (tvisnil(o)) {
+	cTValue *tv = lj_tab_get(L, t, &key);
+	if (tvisgcv(tv) && gcV(tv)->gch.gct == gct)
+	  copyTV(L, o, tv);
+      }
+    }
+    if (tvisnil(o)) img_errref(L, &first);
+  }
+  lj_gc_anybarriert(L, ctx->objs);
+}
+
+/* Fill in the contents of a table, Lua function or upvalue. */
+static void img_loadfill(ImgLoadCtx *ctx)
+{
+  lua_State *L = ctx->L;
+  uint32_t id = img_getu(ctx);
+  TValue *o;
+  if (id == 0 || id > ctx->nobj) img_errbad(ctx);
+  o = arrayslot(ctx->objs, id);
+  if (tvistab(o)) {
+    GCtab *t = tabV(o);
+    TValue mt;
+    uint32_t i, n;
+    img_getv(ctx, &mt);
+    if (tvistab(&mt))
+      setgcref(t->metatable, obj2gco(tabV(&mt)));
+    else if (tvisnil(&mt))
+      setgcrefnull(t->metatable);
+    else
+      img_errbad(ctx);
+    n = img_getu(ctx);
+    for (i = 0; i < n; i++) {
+      TValue key;
+      img_getv(ctx, &key);
+      img_getv(ctx, lj_tab_set(L, t, &key));
+    }
+    t->nomm = 0;  /* Invalidate negative metamethod cache. */
+    lj_gc_anybarriert(L, t);
+  } else if (tvisfunc(o) && isluafunc(funcV(o))) {
+    GCfunc *fn = funcV(o);
+    TValue env;
+    MSize i;
+    img_getv(ctx, &env);
+    if (!tvistab(&env)) img_errbad(ctx);
+    setgcref(fn->l.env, obj2gco(tabV(&env)));
+    lj_gc_objbarrier(L, fn, tabV(&env));
+    for (i = 0; i < fn->l.nupvalues; i++) {
+      uint32_t uid = img_getu(ctx);
+      TValue *uv;
+      if (uid == 0 || uid > ctx->nobj) img_errbad(ctx);
+      uv = arrayslot(ctx->objs, uid);
+      if (itype(uv) != LJ_TUPVAL) img_errbad(ctx);
+      setgcref(fn->l.uvptr[i], gcV(uv));
+      lj_gc_objbarrier(L, fn, gcV(uv));
+    }
+  } else if (itype(o) == LJ_TUPVAL) {
+    GCupval *uv = &gcV(o)->uv;
+    img_getv(ctx, &uv->tv);
+    lj_gc_barrier(L, uv, &uv->tv);
+  } else {
+    img_errbad(ctx);
+  }
+}
+
+static TValue *cpimgload(lua_State *L, lua_CFunction dummy, void *ud)
+{
+  ImgLoadCtx *ctx = (ImgLoadCtx *)ud;
+  global_State *g = G(L);
+  uint32_t i, n;
+  UNUSED(dummy);
+  img_loadhead(ctx);
+  img_loadctypes(ctx);
+  img_ffinit(L, ctx->ffmap);
+  ctx->pts = lj_tab_new(L, 0, 0);
+  settabV(L, L->top, ctx->pts);
+  incr_top(L);
+  img_loaddumps(ctx);
+  ctx->nobj = img_getu(ctx);
+  if (ctx->nobj >= LJ_MAX_ASIZE) img_errbad(ctx);
+  ctx->objs = lj_tab_new(L, ctx->nobj+1, 0);
+  settabV(L, L->top, ctx->objs);
+  incr_top(L);
+  if (g->strnum + ctx->nobj > g->strmask) {  /* Avoid repeated rehashing. */
+    MSize newmask = g->strmask;
+    while (newmask < g->strnum + ctx->nobj) newmask = (newmask << 1) | 1;
+    lj_str_resize(L, newmask);
+  }
+  for (i = 1; i <= ctx->nobj; i++) {
+    TValue tv;
+    img_loadobj(ctx, &tv);
+    copyTV(L, arrayslot(ctx->objs, i), &tv);
+  }
+  lj_gc_anybarriert(L, ctx->objs);
+  img_loadnames(ctx);
+  n = img_getu(ctx);
+  for (i = 0; i < n; i++)
+    img_loadfill(ctx);
+  if (ctx->p != ctx->pe) img_errbad(ctx);
+  L->top -= 2;
+  return NULL;
+}
+
+/* Restore a snapshot into the state. */
+LUA_API int luaJIT_loadimage(lua_State *L, const char *buf, size_t size)
+{
+  ImgLoadCtx ctx;
+  global_State *g = G(L);
+  uint8_t lazyload = g->lazyload;
+  int status;
+  ctx.L = L;
+  ctx.p = (const uint8_t *)buf;
+  ctx.pe = (const uint8_t *)buf + size;
+  ctx.nobj = ctx.npt = 0;
+  g->lazyload = 0;  /* Prototypes are numbered after loading them. */
+  status = lj_vm_cpcall(L, NULL, &ctx, cpimgload);
+  g->lazyload = lazyload;
+  lj_gc_check(L);
+  return status;
+}
@@ -163,14 +163,32 @@ static LJ_AINLINE IRRef ir_nextk(jit_State *J)
   return ref;
 }
 
+/* Constant lookup cache. Big traces have hundreds of constants and a
+** linear search of the chain for every lookup shows up in compile times.
+** A cached ref is only used after checking that it's a constant of the
+** current trace with the same value. So the cache never needs flushing.
+*/
+static LJ_AINLINE IRRef1 *ir_kcache(jit_State *J, IROp op, uint32_t k)
+{
+  uint32_t h = (k ^ ((uint32_t)op << 24)) * 0x9e3779b1u;
+  return &J->kcache[h >> (32-KCACHE_BITS)];
+}
+
+/* Check whether a cached ref is a constant of the current trace. */
+#define ir_kcached(J, ref, op) \
+  ((ref) >= (J)->cur.nk && (ref) < REF_BIAS && (J)->cur.ir[(ref)].o == (op))
+
 /* Intern int32_t constant. */
 TRef LJ_FASTCALL lj_ir_kint(jit_State *J, int32_t k)
 {
   IRIns *ir, *cir = J->cur.ir;
-  IRRef ref;
+  IRRef1 *kc = ir_kcache(J, IR_KINT, (uint32_t)k);
+  IRRef ref = *kc;
+  if (ir_kcached(J, ref, IR_KINT) && cir[ref].i == k)
+    goto found;
   for (ref = J->chain[IR_KINT]; ref; ref = cir[ref].prev)
     if (cir[ref].i == k)
-      goto found;
+      goto cache;
   ref = ir_nextk(J);
   ir = IR(ref);
   ir->i = k;
@@ -178,6 +196,8 @@ TRef LJ_FASTCALL lj_ir_kint(jit_State *J, int32_t k)
   ir->o = IR_KINT;
   ir->prev = J->chain[IR_KINT];
   J->chain[IR_KINT] = (IRRef1)ref;
+cache:
+  *kc = (IRRef1)ref;
 found:
   return TREF(ref, IRT_INT);
 }
@@ -246,9 +266,13 @@ TRef lj_ir_k64(jit_State *J, IROp op, cTValue *tv)
   IRIns *ir, *cir = J->cur.ir;
   IRRef ref;
   IRType t = op == IR_KNUM ? IRT_NUM : IRT_I64;
+  IRRef1 *kc = ir_kcache(J, op, (uint32_t)(uintptr_t)tv >> 3);
+  ref = *kc;
+  if (ir_kcached(J, ref, op) && ir_k64(&cir[ref]) == tv)
+    goto found;
   for (ref = J->chain[op]; ref; ref = cir[ref].prev)
     if (ir_k64(&cir[ref]) == tv)
-      goto found;
+      goto cache;
   ref = ir_nextk(J);
   ir = IR(ref);
   lua_assert(checkptr32(tv));
@@ -257,6 +281,8 @@ TRef lj_ir_k64(jit_State *J, IROp op, cTValue *tv)
   ir->o = op;
   ir->prev = J->chain[op];
   J->chain[op] = (IRRef1)ref;
+cache:
+  *kc = (IRRef1)ref;
 found:
   return TREF(ref, t);
 }
@@ -305,10 +331,14 @@ TRef lj_ir_kgc(jit_State *J, GCobj *o, IRType t)
 {
   IRIns *ir, *cir = J->cur.ir;
   IRRef ref;
+  IRRef1 *kc = ir_kcache(J, IR_KGC, (uint32_t)(uintptr_t)o >> 3);
   lua_assert(!isdead(J2G(J), o));
+  ref = *kc;
+  if (ir_kcached(J, ref, IR_KGC) && ir_kgc(&cir[ref]) == o)
+    goto found;
   for (ref = J->chain[IR_KGC]; ref; ref = cir[ref].prev)
     if (ir_kgc(&cir[ref]) == o)
-      goto found;
+      goto cache;
   ref = ir_nextk(J);
   ir = IR(ref);
   /* NOBARRIER: Current trace is a GC root. */
@@ -317,6 +347,8 @@ TRef lj_ir_kgc(jit_State *J, GCobj *o, IRType t)
   ir->o = IR_KGC;
   ir->prev = J->chain[IR_KGC];
   J->chain[IR_KGC] = (IRRef1)ref;
+cache:
+  *kc = (IRRef1)ref;
 found:
   return TREF(ref, t);
 }
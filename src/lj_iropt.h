@@ -145,6 +145,8 @@ LJ_FUNC TRef lj_opt_narrow_unm(jit_State *J, TRef rc, TValue *vc);
 LJ_FUNC TRef lj_opt_narrow_mod(jit_State *J, TRef rb, TRef rc, TValue *vc);
 LJ_FUNC TRef lj_opt_narrow_pow(jit_State *J, TRef rb, TRef rc, TValue *vc);
 LJ_FUNC IRType lj_opt_narrow_forl(jit_State *J, cTValue *forbase);
+LJ_FUNC int lj_opt_narrow_range(jit_State *J, IRRef ref, TRef tr[2],
+				int32_t k[2]);
 
 /* Optimization passes. */
 LJ_FUNC void lj_opt_dce(jit_State *J);
@@ -71,18 +71,20 @@
 #define JIT_F_OPT_ABC		0x00800000
 #define JIT_F_OPT_SINK		0x01000000
 #define JIT_F_OPT_FUSE		0x02000000
+#define JIT_F_OPT_VEC		0x04000000
 
 /* Optimizations names for -O. Must match the order above. */
 #define JIT_F_OPT_FIRST		JIT_F_OPT_FOLD
 #define JIT_F_OPTSTRING	\
-  "\4fold\3cse\3dce\3fwd\3dse\6narrow\4loop\3abc\4sink\4fuse"
+  "\4fold\3cse\3dce\3fwd\3dse\6narrow\4loop\3abc\4sink\4fuse\3vec"
 
 /* Optimization levels set a fixed combination of flags. */
 #define JIT_F_OPT_0	0
 #define JIT_F_OPT_1	(JIT_F_OPT_FOLD|JIT_F_OPT_CSE|JIT_F_OPT_DCE)
 #define JIT_F_OPT_2	(JIT_F_OPT_1|JIT_F_OPT_NARROW|JIT_F_OPT_LOOP)
 #define JIT_F_OPT_3	(JIT_F_OPT_2|\
-  JIT_F_OPT_FWD|JIT_F_OPT_DSE|JIT_F_OPT_ABC|JIT_F_OPT_SINK|JIT_F_OPT_FUSE)
+  JIT_F_OPT_FWD|JIT_F_OPT_DSE|JIT_F_OPT_ABC|JIT_F_OPT_SINK|JIT_F_OPT_FUSE|\
+  JIT_F_OPT_VEC)
 #define JIT_F_OPT_DEFAULT	JIT_F_OPT_3
 
 #if LJ_TARGET_WINDOWS || LJ_64
@@ -188,6 +190,9 @@ LJ_STATIC_ASSERT(SNAP_CONT == TREF_CONT);
 #define snap_pc(sn)		((const BCIns *)(uintptr_t)(sn))
 #define snap_setref(sn, ref)	(((sn) & (0xffff0000&~SNAP_NORESTORE)) | (ref))
 
+/* Compiled snapshot restore instruction. See lj_snap.c. */
+typedef uint32_t SnapRestore;
+
 /* Snapshot and exit numbers. */
 typedef uint32_t SnapNo;
 typedef uint32_t ExitNo;
@@ -205,7 +210,8 @@ typedef enum {
   LJ_TRLINK_UPREC,		/* Up-recursion. */
   LJ_TRLINK_DOWNREC,		/* Down-recursion. */
   LJ_TRLINK_INTERP,		/* Fallback to interpreter. */
-  LJ_TRLINK_RETURN		/* Return to interpreter. */
+  LJ_TRLINK_RETURN,		/* Return to interpreter. */
+  LJ_TRLINK_STITCH		/* Trace stitching. */
 } TraceLink;
 
 /* Trace object. */
@@ -221,6 +227,7 @@ typedef struct GCtrace {
   uint16_t nsnapmap;	/* Number of snapshot map elements. */
   SnapShot *snap;	/* Snapshot array. */
   SnapEntry *snapmap;	/* Snapshot map. */
+  SnapRestore *snaprs;	/* Compiled snapshot restore, parallel to snapmap. */
   GCRef startpt;	/* Starting prototype. */
   MRef startpc;		/* Bytecode PC of starting instruction. */
   BCIns startins;	/* Original bytecode of starting instruction. */
@@ -235,7 +242,11 @@ typedef struct GCtrace {
   TraceNo1 nextroot;	/* Next root trace for same prototype. */
   TraceNo1 nextside;	/* Next side trace of same root trace. */
   uint8_t sinktags;	/* Trace has SINK tags. */
-  uint8_t unused1;
+  uint8_t unstable;	/* Consecutive entries ending at the same exit. */
+  uint32_t hits;	/* Entries from the interpreter (saturating, decays). */
+  uint32_t unsthits;	/* Value of hits at the last exit. */
+  uint32_t exits;	/* Exits taken (saturating). */
+  uint16_t unstexit;	/* Exit number of the last exit. */
 #ifdef LUAJIT_USE_GDBJIT
   void *gdbjit_entry;	/* GDB JIT entry. */
 #endif
@@ -277,6 +288,10 @@ typedef struct BPropEntry {
 /* Number of slots for the backpropagation cache. Must be a power of 2. */
 #define BPROP_SLOTS	16
 
+/* Number of slots for the constant lookup cache. Must be a power of 2. */
+#define KCACHE_BITS	8
+#define KCACHE_SLOTS	(1u << KCACHE_BITS)
+
 /* Scalar evolution analysis cache. */
 typedef struct ScEvEntry {
   MRef pc;		/* Bytecode PC of FORI. */
@@ -288,6 +303,33 @@ typedef struct ScEvEntry {
   uint8_t dir;		/* Direction. 1: +, 0: -. */
 } ScEvEntry;
 
+/* Aggregated trace aborts for one bytecode location. */
+typedef struct TraceStatLoc {
+  MRef pc;		/* Bytecode PC where recording was aborted. */
+  uint32_t count;	/* Number of aborts at this PC. */
+  BCLine line;		/* Source line of PC. */
+  uint16_t reason;	/* Last abort reason (really TraceErr). */
+  char name[LUA_IDSIZE];  /* Short chunk name. Copied, since PC isn't a GC ref. */
+} TraceStatLoc;
+
+#define STATLOC_SLOTS	16	/* Abort location slots, least aborts replaced. */
+#define STATERR_MAX	64	/* Max. number of abort reasons. */
+
+/* Aggregate trace compiler statistics. Always collected. */
+typedef struct TraceStats {
+  uint32_t start;	/* Started root traces. */
+  uint32_t startside;	/* Started side traces. */
+  uint32_t stop;	/* Completed traces. */
+  uint32_t abort;	/* Aborted traces. */
+  uint32_t flush;	/* Flushes of the whole trace cache. */
+  uint64_t exits;	/* Exits from compiled traces. */
+  uint64_t mcode;	/* Bytes of machine code generated. */
+  double ctime;		/* CPU time for recording and compiling (in s). */
+  double cstart;	/* CPU time at start of current trace. */
+  uint32_t reason[STATERR_MAX];  /* Aborts by reason. */
+  TraceStatLoc loc[STATLOC_SLOTS];  /* Aborts by location. */
+} TraceStats;
+
 /* 128 bit SIMD constants. */
 enum {
   LJ_KSIMD_ABS,
@@ -370,6 +412,7 @@ typedef struct jit_State {
   MSize sizetrace;	/* Size of trace array. */
 
   IRRef1 chain[IR__MAX];  /* IR instruction skip-list chain anchors. */
+  IRRef1 kcache[KCACHE_SLOTS];  /* Constant lookup cache. */
   TRef slot[LJ_MAX_JSLOTS+LJ_STACK_EXTRA];  /* Stack slot map. */
 
   int32_t param[JIT_P__MAX];  /* JIT engine parameters. */
@@ -385,6 +428,8 @@ typedef struct jit_State {
 
   ScEvEntry scev;	/* Scalar evolution analysis cache slots. */
 
+  TraceStats stats;	/* Aggregate trace compiler statistics. */
+
   const BCIns *startpc;	/* Bytecode PC of starting instruction. */
   TraceNo parent;	/* Parent of current side trace (0 for root traces). */
   ExitNo exitno;	/* Exit number in parent of current side trace. */
@@ -399,6 +444,12 @@ typedef struct jit_State {
   size_t szmcarea;	/* Size of current mcode area. */
   size_t szallmcarea;	/* Total size of all allocated mcode areas. */
 
+#ifdef LUAJIT_USE_PERFTOOLS
+  uint32_t perfmode;	/* Enabled output for Linux perf tools. */
+  MSize sizeperfmc;	/* Size of perfmc buffer. */
+  MCode **perfmc;	/* Start of machine code for each snapshot. */
+#endif
+
   TValue errinfo;	/* Additional info element for trace errors. */
 }
 #if LJ_TARGET_ARM
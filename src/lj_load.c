@@ -11,6 +11,7 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "luajit.h"
 
 #include "lj_obj.h"
 #include "lj_gc.h"
@@ -45,8 +46,8 @@ static TValue *cpparser(lua_State *L, lua_CFunction dummy, void *ud)
   return NULL;
 }
 
-LUA_API int lua_loadx(lua_State *L, lua_Reader reader, void *data,
-		      const char *chunkname, const char *mode)
+static int load_reader(lua_State *L, lua_Reader reader, void *data,
+		       const char *chunkname, const char *mode, int mapped)
 {
   LexState ls;
   int status;
@@ -54,6 +55,7 @@ LUA_API int lua_loadx(lua_State *L, lua_Reader reader, void *data,
   ls.rdata = data;
   ls.chunkarg = chunkname ? chunkname : "?";
   ls.mode = mode;
+  ls.mapped = mapped;
   lj_str_initbuf(&ls.sb);
   status = lj_vm_cpcall(L, NULL, &ls, cpparser);
   lj_lex_cleanup(L, &ls);
@@ -61,6 +63,12 @@ LUA_API int lua_loadx(lua_State *L, lua_Reader reader, void *data,
   return status;
 }
 
+LUA_API int lua_loadx(lua_State *L, lua_Reader reader, void *data,
+		      const char *chunkname, const char *mode)
+{
+  return load_reader(L, reader, data, chunkname, mode, 0);
+}
+
 LUA_API int lua_load(lua_State *L, lua_Reader reader, void *data,
 		     const char *chunkname)
 {
@@ -154,6 +162,19 @@ LUALIB_API int luaL_loadstring(lua_State *L, const char *s)
   return luaL_loadbuffer(L, s, strlen(s), s);
 }
 
+/* Load from a buffer which must stay mapped for the lifetime of the state. */
+LUA_API int luaJIT_loadmapped(lua_State *L, const char *buf, size_t size,
+			      const char *name)
+{
+  StringReaderCtx ctx;
+  /* Can only reference it with 32 bit pointers. Otherwise copy it. */
+  int mapped = !LJ_64 ||
+	       (uint64_t)(uintptr_t)buf + size <= U64x(00000001,00000000);
+  ctx.str = buf;
+  ctx.size = size;
+  return load_reader(L, reader_string, &ctx, name, NULL, mapped);
+}
+
 /* -- Dump bytecode ------------------------------------------------------- */
 
 LUA_API int lua_dump(lua_State *L, lua_Writer writer, void *data)
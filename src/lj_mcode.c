@@ -293,6 +293,58 @@ void lj_mcode_free(jit_State *J)
   }
 }
 
+/* Get the next older MCode area after mc or after the current area if NULL.
+** The current area itself is never returned.
+*/
+MCode *lj_mcode_nextarea(jit_State *J, MCode *mc, size_t *szp)
+{
+  if (!mc) mc = J->mcarea;
+  if (!mc) return NULL;
+  mc = ((MCLink *)mc)->next;
+  if (mc) *szp = ((MCLink *)mc)->size;
+  return mc;
+}
+
+/* Check whether an MCode area holds live machine code or exit stubs. */
+static int mcode_inuse(jit_State *J, MCode *mc, size_t sz)
+{
+  MCode *end = (MCode *)((char *)mc + sz);
+  MSize i;
+  for (i = 0; i < LJ_MAX_EXITSTUBGR; i++) {
+    MCode *p = J->exitstubgroup[i];
+    if (p >= mc && p < end)
+      return 1;
+  }
+  for (i = 1; i < J->sizetrace; i++) {
+    GCtrace *T = traceref(J, i);
+    if (T && T->mcode >= mc && T->mcode < end)
+      return 1;
+  }
+  return 0;
+}
+
+/* Free all older MCode areas which don't hold any live machine code. */
+void lj_mcode_reclaim(jit_State *J)
+{
+  MCode *mc = J->mcarea;
+  while (mc) {
+    MCode *next = ((MCLink *)mc)->next;
+    size_t sz;
+    if (!next)
+      break;
+    sz = ((MCLink *)next)->size;
+    if (mcode_inuse(J, next, sz)) {
+      mc = next;
+    } else {  /* Unlink and free the area. */
+      lj_mcode_patch(J, mc, 0);
+      ((MCLink *)mc)->next = ((MCLink *)next)->next;
+      lj_mcode_patch(J, mc, 1);
+      J->szallmcarea -= sz;
+      mcode_free(J, next, sz);
+    }
+  }
+}
+
 /* -- MCode transactions -------------------------------------------------- */
 
 /* Reserve the remainder of the current MCode area. */
@@ -364,8 +416,9 @@ void lj_mcode_limiterr(jit_State *J, size_t need)
   maxmcode = (size_t)J->param[JIT_P_maxmcode] << 10;
   if ((size_t)need > sizemcode)
     lj_trace_err(J, LJ_TRERR_MCODEOV);  /* Too long for any area. */
-  if (J->szallmcarea + sizemcode > maxmcode)
-    lj_trace_err(J, LJ_TRERR_MCODEAL);
+  while (J->szallmcarea + sizemcode > maxmcode)
+    if (!lj_trace_evictmcode(J))  /* Try to evict the coldest area first. */
+      lj_trace_err(J, LJ_TRERR_MCODEAL);
   mcode_allocarea(J);
   lj_trace_err(J, LJ_TRERR_MCODELM);  /* Retry with new area. */
 }
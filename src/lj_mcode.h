@@ -22,6 +22,8 @@ LJ_FUNC void lj_mcode_commit(jit_State *J, MCode *m);
 LJ_FUNC void lj_mcode_abort(jit_State *J);
 LJ_FUNC MCode *lj_mcode_patch(jit_State *J, MCode *ptr, int finish);
 LJ_FUNC_NORET void lj_mcode_limiterr(jit_State *J, size_t need);
+LJ_FUNC MCode *lj_mcode_nextarea(jit_State *J, MCode *mc, size_t *szp);
+LJ_FUNC void lj_mcode_reclaim(jit_State *J);
 
 #define lj_mcode_commitbot(J, m)	(J->mcbot = (m))
 
@@ -506,6 +506,8 @@ typedef struct GCState {
   MSize estimate;	/* Estimate of memory actually in use. */
   MSize pause;		/* Pause between successive GC cycles. */
   GCRef grayagain;  /* List of objects for atomic traversal. */
+  GCRef freeth;		/* List of dead threads kept for reuse. */
+  MSize nfreeth;	/* Number of threads in freeth list. */
 } GCState;
 
 /* Global state, shared by all threads of a Lua universe. */
@@ -520,6 +522,7 @@ typedef struct global_State {
   uint8_t stremptyz;	/* Zero terminator of empty string. */
   uint8_t dispatchmode;	/* Dispatch mode. */
   uint8_t vmevmask;	/* VM event mask. */
+  uint8_t lazyload;	/* Load bytecode prototypes on demand. */
   GCRef mainthref;	/* Link to main thread. */
   TValue registrytv;	/* Anchor for registry. */
   TValue tmptv, tmptv2;	/* Temporary TValues. */
@@ -1233,6 +1233,79 @@ LJFOLDF(simplify_intmul_k64)
   return NEXTFOLD;
 }
 
+#if LJ_64
+/* Shift for a 64 bit power of two or -1. */
+static int32_t kfold_int64log2(uint64_t k)
+{
+  if (k < 2 || (k & (k-1)) != 0 || k == U64x(80000000,00000000))
+    return -1;
+  return (uint32_t)k ? (int32_t)lj_ffs((uint32_t)k) :
+		       32+(int32_t)lj_ffs((uint32_t)(k >> 32));
+}
+
+/* Bias to add before shifting a signed dividend right by sh. */
+static TRef kfold_int64divbias(jit_State *J, IRRef ref, int32_t sh)
+{
+  TRef tmp = emitir(IRT(IR_BSAR, IRT_I64), ref, lj_ir_kint(J, 63));
+  tmp = emitir(IRT(IR_BSHR, IRT_I64), tmp, lj_ir_kint(J, 64-sh));
+  return emitir(IRT(IR_ADD, IRT_I64), ref, tmp);
+}
+#endif
+
+LJFOLD(DIV any KINT64)
+LJFOLDF(simplify_intdiv_k64)
+{
+  uint64_t k = ir_kint64(fright)->u64;
+  if (k == 1)  /* i / 1 ==> i */
+    return LEFTFOLD;
+#if LJ_64
+  /* NYI: SPLIT for BSHR/BSAR and 32 bit backend support. */
+  else {
+    int32_t sh = kfold_int64log2(k);
+    if (sh > 0) {
+      if (irt_isu64(fins->t)) {  /* u / 2^k ==> u >> k */
+	fins->o = IR_BSHR;
+      } else {  /* i / 2^k ==> (i + ((i >> 63) >>> (64-k))) >> k */
+	fins->op1 = kfold_int64divbias(J, fins->op1, sh);  /* Clobbers fins! */
+	fins->ot = IRT(IR_BSAR, IRT_I64);
+      }
+      fins->op2 = lj_ir_kint(J, sh);
+      return RETRYFOLD;
+    }
+  }
+#endif
+  return NEXTFOLD;
+}
+
+LJFOLD(MOD any KINT64)
+LJFOLDF(simplify_intmod_k64)
+{
+  uint64_t k = ir_kint64(fright)->u64;
+  if (k == 1)  /* i % 1 ==> 0 */
+    return INT64FOLD(0);
+#if LJ_64
+  else {
+    int32_t sh = kfold_int64log2(k);
+    if (sh > 0) {
+      if (irt_isu64(fins->t)) {  /* u % 2^k ==> u & (2^k-1) */
+	fins->o = IR_BAND;
+	fins->op2 = (IRRef1)lj_ir_kint64(J, k-1);
+      } else {  /* i % 2^k ==> i - ((i + bias) & -2^k) */
+	IRRef ref = fins->op1;
+	TRef tmp = kfold_int64divbias(J, ref, sh);  /* Clobbers fins! */
+	tmp = emitir(IRT(IR_BAND, IRT_I64), tmp,
+		     lj_ir_kint64(J, (uint64_t)-(int64_t)k));
+	fins->ot = IRT(IR_SUB, IRT_I64);
+	fins->op1 = (IRRef1)ref;
+	fins->op2 = (IRRef1)tmp;
+      }
+      return RETRYFOLD;
+    }
+  }
+#endif
+  return NEXTFOLD;
+}
+
 LJFOLD(MOD any KINT)
 LJFOLDF(simplify_intmod_k)
 {
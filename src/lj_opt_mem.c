@@ -830,6 +830,68 @@ doemit:
 
 /* -- Forwarding of lj_tab_len -------------------------------------------- */
 
+/* Derive the length of a table allocated in the trace from its stores.
+**
+** This mirrors lj_tab_len() with all nil/non-nil array slots known and
+** no keys added to the hash part. Any new key may rehash the table and
+** shrink the array part, so any NEWREF or a store to a table which may
+** alias gives up. Folding the length keeps temporary tables sinkable.
+*/
+static TRef fwd_tab_len_alloc(jit_State *J, IRIns *ira)
+{
+  IRRef tab = (IRRef)(ira - J->cur.ir);
+  GCtab *kt = ira->o == IR_TDUP ? ir_ktab(IR(ira->op1)) : NULL;
+  MSize asize = kt ? kt->asize : ira->op1;
+  uint64_t seen = 0, nonnil = 0;
+  MSize i, j;
+  IRRef ref;
+  if (asize > 64)
+    return 0;
+  for (ref = J->chain[IR_NEWREF]; ref > tab; ref = IR(ref)->prev) {
+    IRIns *newref = IR(ref);
+    if (newref->op1 == tab || aa_table(J, tab, newref->op1) != ALIAS_NO)
+      return 0;  /* New key may rehash and shrink the array part. */
+  }
+  for (ref = J->chain[IR_ASTORE]; ref > tab; ref = IR(ref)->prev) {
+    IRIns *store = IR(ref), *xr = IR(store->op1);
+    IRRef ta = IR(xr->op1)->op1;
+    if (ta != tab) {
+      if (aa_table(J, tab, ta) != ALIAS_NO)
+	return 0;  /* Store to a table which may alias. */
+    } else if (!irref_isk(xr->op2)) {
+      return 0;  /* Unknown slot. */
+    } else {
+      uint64_t bit = U64x(00000000,00000001) << IR(xr->op2)->i;
+      lua_assert((MSize)IR(xr->op2)->i < asize);
+      if (!(seen & bit)) {  /* Only the last store to a slot counts. */
+	seen |= bit;
+	if (!irt_isnil(IR(store->op2)->t)) nonnil |= bit;
+      }
+    }
+  }
+  if (kt) {  /* Slots not stored to keep the value from the template. */
+    for (i = 0; i < asize; i++)
+      if (!(seen & (U64x(00000000,00000001) << i)) &&
+	  !tvisnil(arrayslot(kt, i)))
+	nonnil |= U64x(00000000,00000001) << i;
+  }
+#define tab_len_nil(k)	(!(nonnil & (U64x(00000000,00000001) << (k))))
+  j = asize;
+  if (j > 1 && tab_len_nil(j-1)) {
+    i = 1;
+    while (j - i > 1) {
+      MSize m = (i+j)/2;
+      if (tab_len_nil(m-1)) j = m; else i = m;
+    }
+    return lj_ir_kint(J, (int32_t)(i-1));
+  }
+#undef tab_len_nil
+  if (j) j--;
+  if (kt && kt->hmask > 0)
+    return 0;  /* Template may have numeric keys in the hash part. */
+  return lj_ir_kint(J, (int32_t)j);
+}
+
 /* This is rather simplistic right now, but better than nothing. */
 TRef LJ_FASTCALL lj_opt_fwd_tab_len(jit_State *J)
 {
@@ -837,6 +899,12 @@ TRef LJ_FASTCALL lj_opt_fwd_tab_len(jit_State *J)
   IRRef lim = tab;  /* Search limit. */
   IRRef ref;
 
+  /* Tables allocated in the trace have a known array part. */
+  if (IR(tab)->o == IR_TNEW || IR(tab)->o == IR_TDUP) {
+    TRef tr = fwd_tab_len_alloc(J, IR(tab));
+    if (tr) return tr;
+  }
+
   /* Any ASTORE is a conflict and limits the search. */
   if (J->chain[IR_ASTORE] > lim) lim = J->chain[IR_ASTORE];
 
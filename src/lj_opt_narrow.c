@@ -98,6 +98,169 @@
 
 #define emitir_raw(ot, a, b)	(lj_ir_set(J, (ot), (a), (b)), lj_ir_emit(J))
 
+/* -- Range analysis of index expressions --------------------------------- */
+
+/* Array indexes inside a FOR loop are often affine functions of the loop
+** induction variable, e.g. t[i+j], t[3*i-2] or t[n-i]. The induction
+** variable is bounded by the start and stop values of the loop. An index
+** expression made up of ADD, SUB and MUL by a constant can only overflow or
+** exceed the array bounds if it does so at either end of that range. And
+** both ends are loop-invariant if all other operands are, too.
+**
+** This allows to check for overflow and array bounds once, before entering
+** the loop. The index expression itself can then use plain integer
+** arithmetic. Correctness does not depend on the invariance of the other
+** operands, because the end points are computed from the very same
+** references. But it's only an improvement if the checks can be hoisted,
+** so the analysis gives up if the operands are not obviously invariant.
+*/
+
+/* Maximum depth of analyzed index expressions. */
+#define NARROW_MAX_RANGE	8
+
+/* Check whether the current instruction is inside the body of the loop. */
+static int narrow_range_inloop(jit_State *J)
+{
+  const BCIns *fori = mref(J->scev.pc, const BCIns);
+  return (fori && J->scev.idx != REF_NIL && irt_isint(J->scev.t) &&
+	  J->scev.start && J->pc > fori && J->pc < fori + bc_j(*fori));
+}
+
+/* Check whether a slot may be written inside the loop body. */
+static int narrow_range_written(jit_State *J, BCReg s)
+{
+  const BCIns *pc = mref(J->scev.pc, const BCIns);
+  const BCIns *pe = pc + bc_j(*pc);
+  for (pc++; pc < pe; pc++) {
+    BCOp op = bc_op(*pc);
+    BCReg a = bc_a(*pc);
+    if (bcmode_a(op) == BCMdst ? a == s :
+	(bcmode_a(op) == BCMbase && a <= s+1))
+      return 1;
+  }
+  return 0;
+}
+
+/* Get runtime value of an invariant operand. Returns 0 if unknown. */
+static int narrow_range_val(jit_State *J, IRRef ref, int64_t *v)
+{
+  IRIns *ir = IR(ref);
+  cTValue *o;
+  if (ir->o == IR_KINT) {
+    *v = ir->i;
+    return 1;
+  }
+  if (ir->o == IR_CONV && (ir->op2 & IRCONV_SRCMASK) == IRT_NUM &&
+      (ir->op2 & IRCONV_CONVMASK) >= IRCONV_INDEX)
+    ir = IR(ir->op1);
+  if (ir->o != IR_SLOAD || (ir->op2 & IRSLOAD_PARENT))
+    return 0;
+  if (!(ir->op2 & IRSLOAD_READONLY) &&
+      (ir->op1 < J->baseslot ||
+       narrow_range_written(J, (BCReg)(ir->op1 - J->baseslot))))
+    return 0;
+  o = &(J->L->base - J->baseslot)[ir->op1];
+  if (!tvisnumber(o))
+    return 0;
+  *v = numberVint(o);
+  return 1;
+}
+
+/* Evaluate an index expression at both ends of the loop range. Returns
+** the coefficient of the induction variable in *c. Returns 0 on failure.
+*/
+static int narrow_range_eval(jit_State *J, IRRef ref, int64_t bound[2],
+			     int64_t v[2], int32_t *c, int depth)
+{
+  IRIns *ir = IR(ref);
+  if (ref == J->scev.idx) {
+    v[0] = bound[0]; v[1] = bound[1];
+    *c = 1;
+    return 1;
+  } else if ((ir->o == IR_ADD || ir->o == IR_SUB ||
+	      ir->o == IR_ADDOV || ir->o == IR_SUBOV) && irt_isint(ir->t)) {
+    int64_t v2[2];
+    int32_t c2;
+    if (depth >= NARROW_MAX_RANGE ||
+	!narrow_range_eval(J, ir->op1, bound, v, c, depth+1) ||
+	!narrow_range_eval(J, ir->op2, bound, v2, &c2, depth+1))
+      return 0;
+    if (ir->o == IR_ADD || ir->o == IR_ADDOV) {
+      v[0] += v2[0]; v[1] += v2[1]; *c += c2;
+    } else {
+      v[0] -= v2[0]; v[1] -= v2[1]; *c -= c2;
+    }
+    /* Each subexpression must not overflow at either end. */
+    return (v[0] == (int32_t)v[0] && v[1] == (int32_t)v[1]);
+  } else if ((ir->o == IR_MUL || ir->o == IR_MULOV || ir->o == IR_BSHL) &&
+	     irt_isint(ir->t) && irref_isk(ir->op2)) {
+    int32_t k = IR(ir->op2)->i;
+    int64_t ck;
+    if (ir->o == IR_BSHL) {  /* FOLD turns MUL by 2^k into BSHL. */
+      if ((uint32_t)k > 14) return 0;
+      k = 1 << k;
+    }
+    if (depth >= NARROW_MAX_RANGE ||
+	!narrow_range_eval(J, ir->op1, bound, v, c, depth+1))
+      return 0;
+    ck = (int64_t)*c * k;
+    if (ck != (int16_t)ck)
+      return 0;  /* Keep the coefficient small. */
+    v[0] *= k; v[1] *= k; *c = (int32_t)ck;
+    return (v[0] == (int32_t)v[0] && v[1] == (int32_t)v[1]);
+  } else if (narrow_range_val(J, ref, v)) {
+    v[1] = v[0];
+    *c = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* Emit an index expression with overflow checks, evaluated at a bound. */
+static TRef narrow_range_emit(jit_State *J, IRRef ref, TRef bound)
+{
+  IRIns *ir = IR(ref);
+  if (ref == J->scev.idx) {
+    return bound;
+  } else if ((ir->o == IR_ADD || ir->o == IR_SUB ||
+	      ir->o == IR_ADDOV || ir->o == IR_SUBOV) && irt_isint(ir->t)) {
+    IROp op = (ir->o == IR_ADD || ir->o == IR_ADDOV) ? IR_ADDOV : IR_SUBOV;
+    IRRef op2 = ir->op2;  /* Note: emitir() may reallocate the IR. */
+    TRef tr1 = narrow_range_emit(J, ir->op1, bound);
+    TRef tr2 = narrow_range_emit(J, op2, bound);
+    return emitir(IRTGI(op), tr1, tr2);
+  } else if (ir->o == IR_MUL || ir->o == IR_MULOV || ir->o == IR_BSHL) {
+    int32_t k = IR(ir->op2)->i;
+    TRef tr1;
+    if (ir->o == IR_BSHL) k = 1 << k;
+    tr1 = narrow_range_emit(J, ir->op1, bound);
+    return emitir(IRTGI(IR_MULOV), tr1, lj_ir_kint(J, k));
+  }
+  return TREF(ref, irt_t(ir->t));
+}
+
+/* Check an index expression at both ends of the loop range. Emits the
+** overflow-checked end points into tr[] and their values into k[].
+** Returns 0 if the expression is not an affine function of the induction
+** variable or if the checks couldn't be hoisted.
+*/
+int lj_opt_narrow_range(jit_State *J, IRRef ref, TRef tr[2], int32_t k[2])
+{
+  int64_t bound[2], v[2];
+  int32_t c;
+  if ((J->flags & JIT_F_OPT_LOOP) && narrow_range_inloop(J) &&
+      narrow_range_val(J, J->scev.start, &bound[0]) &&
+      narrow_range_val(J, J->scev.stop, &bound[1]) &&
+      narrow_range_eval(J, ref, bound, v, &c, 0) && c != 0) {
+    tr[0] = narrow_range_emit(J, ref, TREF(J->scev.start, IRT_INT));
+    tr[1] = narrow_range_emit(J, ref, TREF(J->scev.stop, IRT_INT));
+    k[0] = (int32_t)v[0];
+    k[1] = (int32_t)v[1];
+    return 1;
+  }
+  return 0;
+}
+
 /* -- Elimination of narrowing type conversions --------------------------- */
 
 /* Narrowing of index expressions and bit operations is demand-driven. The
@@ -257,6 +420,25 @@ static void narrow_stripov_backprop(NarrowConv *nc, IRRef ref, int depth)
 }
 
 /* Backpropagate narrowing conversion. Return number of needed conversions. */
+/* Check for a MUL by a small integer constant in an array index. */
+static int narrow_conv_scaled(NarrowConv *nc, IRIns *ir)
+{
+#if LJ_TARGET_MIPS
+  UNUSED(nc); UNUSED(ir);
+  return 0;  /* NYI: MULOV. */
+#else
+  jit_State *J = nc->J;
+  IRIns *irk = IR(ir->op2);
+  if ((nc->mode & IRCONV_CONVMASK) == IRCONV_INDEX && nc->t == IRT_INT &&
+      irk->o == IR_KNUM) {
+    lua_Number n = ir_knum(irk)->n;
+    int32_t k = lj_num2int(n);
+    return (checki16(k) && n == (lua_Number)k);
+  }
+  return 0;
+#endif
+}
+
 static int narrow_conv_backprop(NarrowConv *nc, IRRef ref, int depth)
 {
   jit_State *J = nc->J;
@@ -308,8 +490,11 @@ static int narrow_conv_backprop(NarrowConv *nc, IRRef ref, int depth)
     cref = cr->prev;
   }
 
-  /* Backpropagate across ADD/SUB. */
-  if (ir->o == IR_ADD || ir->o == IR_SUB) {
+  /* Backpropagate across ADD/SUB. And across MUL by a small integer constant
+  ** for array indexes, e.g. t[3*i], see narrow_range_eval() above.
+  */
+  if (ir->o == IR_ADD || ir->o == IR_SUB ||
+      (ir->o == IR_MUL && narrow_conv_scaled(nc, ir))) {
     /* Try cache lookup first. */
     IRRef mode = nc->mode;
     BPropEntry *bp;
@@ -347,6 +532,51 @@ static int narrow_conv_backprop(NarrowConv *nc, IRRef ref, int depth)
   return 1;
 }
 
+/* Try to emit an index expression without overflow checks. See above. */
+static IRRef narrow_conv_range(jit_State *J, NarrowConv *nc,
+			       IROpT convot, IRRef1 convop2)
+{
+  TRef stack[NARROW_MAX_STACK], tr[2];
+  NarrowIns *next, *last = nc->sp;
+  TRef *sp = stack;
+  int32_t k[2];
+  int nops = 0;
+  /* First emit the conversions, so both attempts can share them. */
+  for (next = nc->stack; next < last; next++) {
+    IROpT op = narrow_op(*next);
+    if (op == NARROW_CONV)
+      *next = NARROWINS(NARROW_REF, tref_ref(emitir_raw(convot,
+				    narrow_ref(*next), convop2)));
+    else if (op == NARROW_INT)
+      next++;
+  }
+  for (next = nc->stack; next < last; ) {
+    NarrowIns ref = *next++;
+    IROpT op = narrow_op(ref);
+    if (op == NARROW_REF) {
+      *sp++ = TREF(narrow_ref(ref), IRT_INT);
+    } else if (op == NARROW_INT) {
+      *sp++ = lj_ir_kint(J, *next++);
+    } else {
+      lua_assert(sp >= stack+2 && op != NARROW_SEXT);
+      sp--;
+      sp[-1] = emitir(op, sp[-1], sp[0]);
+      nops++;
+    }
+  }
+  lua_assert(sp == stack+1);
+  /* Nothing to gain for t[i+1] et al. The ADD is emitted without checks. */
+  if (nops == 1 && !tref_isk(stack[0])) {
+    IRIns *ir = IR(tref_ref(stack[0]));
+    if (ir->o != IR_MUL && irref_isk(ir->op2) &&
+	(uint32_t)IR(ir->op2)->i + 0x40000000u < 0x80000000u)
+      return 0;
+  }
+  if (lj_opt_narrow_range(J, tref_ref(stack[0]), tr, k))
+    return tref_ref(stack[0]);
+  return 0;
+}
+
 /* Emit the conversions collected during backpropagation. */
 static IRRef narrow_conv_emit(jit_State *J, NarrowConv *nc)
 {
@@ -357,6 +587,12 @@ static IRRef narrow_conv_emit(jit_State *J, NarrowConv *nc)
   NarrowIns *next = nc->stack;  /* List of instructions from backpropagation. */
   NarrowIns *last = nc->sp;
   NarrowIns *sp = nc->stack;  /* Recycle the stack to store operands. */
+  if (guardot && (nc->mode & IRCONV_CONVMASK) == IRCONV_INDEX &&
+      nc->t == IRT_INT && (J->flags & JIT_F_OPT_ABC) &&
+      narrow_range_inloop(J)) {
+    IRRef ref = narrow_conv_range(J, nc, convot, convop2);
+    if (ref) return ref;
+  }
   while (next < last) {  /* Simple stack machine to process the ins. list. */
     NarrowIns ref = *next++;
     IROpT op = narrow_op(ref);
@@ -380,6 +616,7 @@ static IRRef narrow_conv_emit(jit_State *J, NarrowConv *nc)
       /* Omit some overflow checks for array indexing. See comments above. */
       if ((mode & IRCONV_CONVMASK) == IRCONV_INDEX) {
 	if (next == last && irref_isk(narrow_ref(sp[0])) &&
+	  (op >> 8) != IR_MUL &&
 	  (uint32_t)IR(narrow_ref(sp[0]))->i + 0x40000000u < 0x80000000u)
 	  guardot = 0;
 	else  /* Otherwise cache a stronger check. */
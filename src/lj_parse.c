@@ -1640,7 +1640,10 @@ static void fs_init(LexState *ls, FuncState *fs)
   fs->bl = NULL;
   fs->flags = 0;
   fs->framesize = 1;  /* Minimum frame size. */
-  fs->kt = lj_tab_new(L, 0, 0);
+  /* Presize the constant table. It anchors all names, too, so it fills up
+  ** quickly and growing it one rehash at a time dominates parsing time.
+  */
+  fs->kt = lj_tab_new(L, 0, 5);
   /* Anchor table of constants in stack to avoid being collected. */
   settabV(L, L->top, fs->kt);
   incr_top(L);
@@ -0,0 +1,473 @@
+/*
+** Client for the Linux perf tools.
+** Copyright (C) 2005-2014 Mike Pall. See Copyright Notice in luajit.h
+*/
+
+#define lj_perf_c
+#define LUA_CORE
+
+#include "lj_obj.h"
+
+#if LJ_HASJIT
+
+#include "lj_gc.h"
+#include "lj_debug.h"
+#include "lj_frame.h"
+#include "lj_jit.h"
+#include "lj_dispatch.h"
+#include "lj_perf.h"
+#include "luajit.h"
+
+/* This is not compiled in by default.
+** Enable with -DLUAJIT_USE_PERFTOOLS in the Makefile and recompile everything.
+*/
+#ifdef LUAJIT_USE_PERFTOOLS
+
+/* Two kinds of output are supported, both can be switched at runtime with
+** luaJIT_setmode(L, LUAJIT_PERF_*, LUAJIT_MODE_PERF|LUAJIT_MODE_ON/OFF):
+**
+** LUAJIT_PERF_MAP (on by default) appends the start address, size and
+** name of each trace to /tmp/perf-<pid>.map. perf picks this up without
+** further setup, but only gives a flat symbol per trace:
+**
+**   perf record -e cycles luajit test.lua
+**   perf report -s symbol
+**   rm perf.data /tmp/perf-*.map
+**
+** LUAJIT_PERF_JITDUMP writes jit-<pid>.dump to the current directory.
+** Each trace gets a copy of its machine code, a line table derived from
+** the snapshots and, for x86/x64, frame unwind information. The file is
+** mmap'ed once, which makes perf record it as a marker. 'perf inject'
+** then turns the records into one ELF object per trace, so annotation
+** and call graphs across traces work, too:
+**
+**   perf record -k mono -g luajit test.lua
+**   perf inject --jit -i perf.data -o perf.data.jitted
+**   perf report -i perf.data.jitted
+**   rm perf.data* jit-*.dump ~/.debug/jit/...
+**
+** The trace names TRACE_<n>::<file>:<line> match the output of -jv.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* -- jitdump definitions ------------------------------------------------- */
+
+#define JITDUMP_MAGIC		0x4A695444	/* "JiTD" in native byte order. */
+#define JITDUMP_VERSION		1
+
+enum {
+  JITDUMP_CODE_LOAD = 0,
+  JITDUMP_CODE_MOVE = 1,
+  JITDUMP_CODE_DEBUG_INFO = 2,
+  JITDUMP_CODE_CLOSE = 3,
+  JITDUMP_CODE_UNWINDING_INFO = 4
+};
+
+typedef struct JDheader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} JDheader;
+
+typedef struct JDrecord {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+} JDrecord;
+
+typedef struct JDcodeload {
+  JDrecord rec;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  /* Followed by zero-terminated name and the machine code. */
+} JDcodeload;
+
+typedef struct JDdebuginfo {
+  JDrecord rec;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+  /* Followed by nr_entry * (JDdebugentry + zero-terminated file name). */
+} JDdebuginfo;
+
+typedef struct JDdebugentry {
+  uint64_t addr;
+  uint32_t lineno;
+  uint32_t discrim;
+} JDdebugentry;
+
+typedef struct JDunwinding {
+  JDrecord rec;
+  uint64_t unwinding_size;
+  uint64_t eh_frame_hdr_size;
+  uint64_t mapped_size;
+  /* Followed by .eh_frame, .eh_frame_hdr and padding to 8 bytes. */
+} JDunwinding;
+
+/* Open jitdump file or NULL. Never closed, perf reads it after exit. */
+static FILE *perf_dumpfp;
+static uint64_t perf_codeindex;
+
+/* Monotonic timestamp in ns. Must match 'perf record -k mono'. */
+static uint64_t perf_timestamp(void)
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void perf_initrec(JDrecord *rec, uint32_t id, size_t sz)
+{
+  rec->id = id;
+  rec->total_size = (uint32_t)sz;
+  rec->timestamp = perf_timestamp();
+}
+
+/* Create jitdump file, write header and mmap it as a marker for perf. */
+static int perf_opendump(void)
+{
+  char fname[40];
+  JDheader hdr;
+  long pgsz = sysconf(_SC_PAGESIZE);
+  int fd;
+  sprintf(fname, "jit-%d.dump", getpid());
+  fd = open(fname, O_CREAT|O_TRUNC|O_RDWR, 0666);
+  if (fd < 0)
+    return 0;
+  if (mmap(NULL, pgsz > 0 ? (size_t)pgsz : 4096, PROT_READ|PROT_EXEC,
+	   MAP_PRIVATE, fd, 0) == MAP_FAILED ||
+      !(perf_dumpfp = fdopen(fd, "wb"))) {
+    close(fd);
+    return 0;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = JITDUMP_MAGIC;
+  hdr.version = JITDUMP_VERSION;
+  hdr.total_size = sizeof(JDheader);
+#if LJ_TARGET_X86
+  hdr.elf_mach = 3;
+#elif LJ_TARGET_X64
+  hdr.elf_mach = 62;
+#elif LJ_TARGET_ARM
+  hdr.elf_mach = 40;
+#elif LJ_TARGET_PPC
+  hdr.elf_mach = 20;
+#elif LJ_TARGET_MIPS
+  hdr.elf_mach = 8;
+#else
+#error "Unsupported target architecture"
+#endif
+  hdr.pid = (uint32_t)getpid();
+  hdr.timestamp = perf_timestamp();
+  fwrite(&hdr, sizeof(hdr), 1, perf_dumpfp);
+  fflush(perf_dumpfp);
+  return 1;
+}
+
+/* -- Line table ---------------------------------------------------------- */
+
+/* Get file name of prototype. */
+static const char *perf_filename(GCproto *pt)
+{
+  const char *name = proto_chunknamestr(pt);
+  if (name[0] == '@' || name[0] == '=')
+    return name+1;
+  return "(string)";
+}
+
+/* Get prototype for the innermost frame of a snapshot. */
+static GCproto *perf_snapproto(GCtrace *T, SnapShot *snap, const BCIns *pc)
+{
+  SnapEntry *map = &T->snapmap[snap->mapofs];
+  GCproto *pt = &gcref(T->startpt)->pt;
+  MSize n;
+  for (n = snap->nent; n > 0; n--) {
+    SnapEntry sn = map[n-1];
+    if (snap_isframe(sn)) {
+      IRIns *ir = &T->ir[snap_ref(sn)];
+      if (ir->o == IR_KGC && isluafunc(ir_kfunc(ir)))
+	pt = funcproto(ir_kfunc(ir));
+      break;
+    }
+  }
+  /* The base frame of a side trace may not hold the start prototype. */
+  return proto_bcpos(pt, pc) < pt->sizebc ? pt : NULL;
+}
+
+/* Write line table entries for the code range of each snapshot.
+** Returns the record size, only counts the entries if fp is NULL.
+*/
+static MSize perf_lines(jit_State *J, GCtrace *T, FILE *fp, MSize *np)
+{
+  MSize sz = sizeof(JDdebuginfo), n = 0, i;
+  BCLine lastline = -1;
+  GCproto *lastpt = NULL;
+  for (i = 0; i < T->nsnap; i++) {
+    SnapShot *snap = &T->snap[i];
+    const BCIns *pc = snap_pc(T->snapmap[snap->mapofs + snap->nent]);
+    GCproto *pt = perf_snapproto(T, snap, pc);
+    const char *name;
+    BCLine line;
+    if (!pt) continue;
+    line = lj_debug_line(pt, proto_bcpos(pt, pc));
+    if (line == lastline && pt == lastpt) continue;
+    lastline = line; lastpt = pt;
+    name = perf_filename(pt);
+    if (fp) {
+      JDdebugentry ent;
+      ent.addr = (uint64_t)(uintptr_t)(i == 0 ? T->mcode : J->perfmc[i]);
+      ent.lineno = (uint32_t)line;
+      ent.discrim = 0;
+      fwrite(&ent, sizeof(ent), 1, fp);
+      fwrite(name, strlen(name)+1, 1, fp);
+    }
+    sz += sizeof(JDdebugentry) + (MSize)strlen(name)+1;
+    n++;
+  }
+  *np = n;
+  return sz;
+}
+
+/* Write line table derived from the snapshots. */
+static void perf_debuginfo(jit_State *J, GCtrace *T)
+{
+  JDdebuginfo di;
+  MSize n, sz = perf_lines(J, T, NULL, &n);
+  if (n == 0) return;
+  perf_initrec(&di.rec, JITDUMP_CODE_DEBUG_INFO, sz);
+  di.code_addr = (uint64_t)(uintptr_t)T->mcode;
+  di.nr_entry = n;
+  fwrite(&di, sizeof(di), 1, perf_dumpfp);
+  perf_lines(J, T, perf_dumpfp, &n);
+}
+
+/* -- Unwind information -------------------------------------------------- */
+
+#if LJ_TARGET_X86ORX64
+
+enum {
+  PERF_DW_CFA_nop = 0x0,
+  PERF_DW_CFA_def_cfa = 0xc,
+  PERF_DW_CFA_def_cfa_offset = 0xe,
+  PERF_DW_CFA_offset = 0x80
+};
+
+enum {
+  PERF_DW_EH_PE_udata4 = 0x03,
+  PERF_DW_EH_PE_sdata4 = 0x0b,
+  PERF_DW_EH_PE_pcrel = 0x10,
+  PERF_DW_EH_PE_datarel = 0x30
+};
+
+#if LJ_TARGET_X86
+enum { PERF_DW_REG_BX = 3, PERF_DW_REG_SP = 4, PERF_DW_REG_BP = 5,
+       PERF_DW_REG_SI = 6, PERF_DW_REG_DI = 7, PERF_DW_REG_RA = 8 };
+#else
+enum { PERF_DW_REG_BX = 3, PERF_DW_REG_BP = 6, PERF_DW_REG_SP = 7,
+       PERF_DW_REG_RA = 16 };
+#endif
+
+#define PERF_EH_FRAME_HDR_SIZE	20
+
+#define PB(x)		(*p++ = (uint8_t)(x))
+#define PU32(x)		(*(uint32_t *)p = (uint32_t)(x), p += 4)
+#define PUV(x)		(p = perf_uleb128(p, (x)))
+#define PALIGNNOP(s)	while ((uintptr_t)(p-buf) & ((s)-1)) PB(PERF_DW_CFA_nop)
+
+static uint8_t *perf_uleb128(uint8_t *p, uint32_t v)
+{
+  for (; v >= 0x80; v >>= 7)
+    *p++ = (uint8_t)((v & 0x7f) | 0x80);
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+/* Write .eh_frame and .eh_frame_hdr for a trace.
+** perf inject places them at the next 8 byte boundary after the code.
+*/
+static void perf_unwinding(jit_State *J, GCtrace *T)
+{
+  JDunwinding uw;
+  uint8_t buf[128];
+  uint8_t *p = buf, *cie, *fde;
+  int32_t ehofs = (int32_t)((T->szmcode + 7) & ~7u);
+  MSize ehsz, sz;
+
+  /* CIE. */
+  cie = p; p += 4;
+  PU32(0);			/* CIE id. */
+  PB(1);			/* Version. */
+  PB('z'); PB('R'); PB(0);	/* Augmentation. */
+  PUV(1);			/* Code alignment factor. */
+  PB(0x80 - sizeof(uintptr_t));	/* Data alignment factor (SLEB128). */
+  PB(PERF_DW_REG_RA);		/* Return address register. */
+  PUV(1); PB(PERF_DW_EH_PE_pcrel|PERF_DW_EH_PE_sdata4);
+  PB(PERF_DW_CFA_def_cfa); PUV(PERF_DW_REG_SP); PUV(sizeof(uintptr_t));
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_RA); PUV(1);
+  PALIGNNOP(sizeof(uintptr_t));
+  *(uint32_t *)cie = (uint32_t)(p-cie-4);
+
+  /* FDE. */
+  fde = p; p += 4;
+  PU32(p-cie);			/* Offset to CIE. */
+  PU32(-(ehofs + (int32_t)(p-buf)));  /* PC-relative start of the code. */
+  PU32(T->szmcode);		/* Machine code length. */
+  PUV(0);			/* Augmentation data. */
+  /* Registers saved in CFRAME. */
+#if LJ_TARGET_X86
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_BP); PUV(2);
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_DI); PUV(3);
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_SI); PUV(4);
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_BX); PUV(5);
+#else
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_BP); PUV(2);
+  PB(PERF_DW_CFA_offset|PERF_DW_REG_BX); PUV(3);
+  PB(PERF_DW_CFA_offset|15); PUV(4);
+  PB(PERF_DW_CFA_offset|14); PUV(5);
+  /* Extra registers saved for JIT-compiled code. */
+  PB(PERF_DW_CFA_offset|13); PUV(9);
+  PB(PERF_DW_CFA_offset|12); PUV(10);
+#endif
+  PB(PERF_DW_CFA_def_cfa_offset); PUV(CFRAME_SIZE_JIT + T->spadjust);
+  PALIGNNOP(sizeof(uintptr_t));
+  *(uint32_t *)fde = (uint32_t)(p-fde-4);
+  PU32(0);			/* Terminator. */
+  ehsz = (MSize)(p-buf);
+
+  /* .eh_frame_hdr with a single entry binary search table. */
+  PB(1);			/* Version. */
+  PB(PERF_DW_EH_PE_pcrel|PERF_DW_EH_PE_sdata4);  /* eh_frame_ptr. */
+  PB(PERF_DW_EH_PE_udata4);	/* fde_count. */
+  PB(PERF_DW_EH_PE_datarel|PERF_DW_EH_PE_sdata4);  /* Table entries. */
+  PU32(-(int32_t)(ehsz+4));	/* Start of .eh_frame. */
+  PU32(1);			/* Number of FDEs. */
+  PU32(-(ehofs + (int32_t)ehsz));  /* Start of the code. */
+  PU32((fde-buf) - (int32_t)ehsz);  /* Start of the FDE. */
+  lua_assert((MSize)(p-buf) == ehsz + PERF_EH_FRAME_HDR_SIZE &&
+	     (size_t)(p-buf) <= sizeof(buf));
+
+  sz = (MSize)(p-buf);
+  perf_initrec(&uw.rec, JITDUMP_CODE_UNWINDING_INFO,
+	       (sizeof(JDunwinding) + sz + 7) & ~7u);
+  uw.unwinding_size = sz;
+  uw.eh_frame_hdr_size = PERF_EH_FRAME_HDR_SIZE;
+  uw.mapped_size = sz;
+  while (((sizeof(JDunwinding) + (MSize)(p-buf)) & 7)) *p++ = 0;
+  fwrite(&uw, sizeof(uw), 1, perf_dumpfp);
+  fwrite(buf, (size_t)(p-buf), 1, perf_dumpfp);
+  UNUSED(J);
+}
+
+#undef PB
+#undef PU32
+#undef PUV
+#undef PALIGNNOP
+
+#endif
+
+/* -- Interface to perf tools --------------------------------------------- */
+
+/* Switch output on or off. */
+int lj_perf_setmode(jit_State *J, int what, int on)
+{
+  if ((what & ~(LUAJIT_PERF_MAP|LUAJIT_PERF_JITDUMP)))
+    return 0;
+  if (on) {
+    if ((what & LUAJIT_PERF_JITDUMP) && !perf_dumpfp && !perf_opendump())
+      return 0;
+    J->perfmode |= (uint32_t)what;
+  } else {
+    J->perfmode &= ~(uint32_t)what;
+  }
+  return 1;
+}
+
+/* Get buffer to note the machine code start of each snapshot or NULL. */
+MCode **lj_perf_snapmc(jit_State *J, MSize nsnap)
+{
+  if (!(J->perfmode & LUAJIT_PERF_JITDUMP))
+    return NULL;
+  if (nsnap > J->sizeperfmc) {  /* Need exactly nsnap entries. */
+    MSize osz = J->sizeperfmc * (MSize)sizeof(MCode *);
+    J->perfmc = (MCode **)lj_mem_realloc(J->L, J->perfmc, osz,
+					  nsnap * (MSize)sizeof(MCode *));
+    J->sizeperfmc = nsnap;
+  }
+  return J->perfmc;
+}
+
+/* Add newly compiled trace. */
+void lj_perf_addtrace(jit_State *J, GCtrace *T)
+{
+  static FILE *mapfp;
+  GCproto *pt = &gcref(T->startpt)->pt;
+  const BCIns *startpc = mref(T->startpc, const BCIns);
+  const char *name = perf_filename(pt);
+  BCLine lineno;
+  lua_assert(startpc >= proto_bc(pt) && startpc < proto_bc(pt) + pt->sizebc);
+  lineno = lj_debug_line(pt, proto_bcpos(pt, startpc));
+  if ((J->perfmode & LUAJIT_PERF_MAP)) {
+    if (!mapfp) {
+      char fname[40];
+      sprintf(fname, "/tmp/perf-%d.map", getpid());
+      if ((mapfp = fopen(fname, "w")))
+	setlinebuf(mapfp);
+    }
+    if (mapfp)
+      fprintf(mapfp, "%lx %x TRACE_%d::%s:%u\n",
+	      (long)T->mcode, T->szmcode, T->traceno, name, lineno);
+  }
+  if ((J->perfmode & LUAJIT_PERF_JITDUMP) && perf_dumpfp && J->perfmc) {
+    JDcodeload cl;
+    char sym[256];
+    MSize len = (MSize)snprintf(sym, sizeof(sym), "TRACE_%d::%s:%u",
+				T->traceno, name, lineno);
+    if (len >= sizeof(sym)) len = sizeof(sym)-1;
+    perf_debuginfo(J, T);
+#if LJ_TARGET_X86ORX64
+    perf_unwinding(J, T);
+#endif
+    perf_initrec(&cl.rec, JITDUMP_CODE_LOAD,
+		 sizeof(JDcodeload) + len+1 + T->szmcode);
+    cl.pid = (uint32_t)getpid();
+    cl.tid = (uint32_t)syscall(SYS_gettid);
+    cl.vma = cl.code_addr = (uint64_t)(uintptr_t)T->mcode;
+    cl.code_size = T->szmcode;
+    cl.code_index = ++perf_codeindex;
+    fwrite(&cl, sizeof(cl), 1, perf_dumpfp);
+    fwrite(sym, len+1, 1, perf_dumpfp);
+    fwrite(T->mcode, T->szmcode, 1, perf_dumpfp);
+    fflush(perf_dumpfp);
+  }
+}
+
+/* Initialize per-state output mode. */
+void lj_perf_initstate(jit_State *J)
+{
+  J->perfmode = LUAJIT_PERF_MAP;  /* Compatible default. */
+}
+
+/* Free per-state buffer. */
+void lj_perf_freestate(jit_State *J)
+{
+  lj_mem_freevec(J2G(J), J->perfmc, J->sizeperfmc, MCode *);
+}
+
+#endif
+#endif
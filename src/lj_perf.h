@@ -0,0 +1,27 @@
+/*
+** Client for the Linux perf tools.
+** Copyright (C) 2005-2014 Mike Pall. See Copyright Notice in luajit.h
+*/
+
+#ifndef _LJ_PERF_H
+#define _LJ_PERF_H
+
+#include "lj_obj.h"
+#include "lj_jit.h"
+
+#if LJ_HASJIT && defined(LUAJIT_USE_PERFTOOLS)
+
+LJ_FUNC int lj_perf_setmode(jit_State *J, int what, int on);
+LJ_FUNC MCode **lj_perf_snapmc(jit_State *J, MSize nsnap);
+LJ_FUNC void lj_perf_addtrace(jit_State *J, GCtrace *T);
+LJ_FUNC void lj_perf_initstate(jit_State *J);
+LJ_FUNC void lj_perf_freestate(jit_State *J);
+
+#else
+#define lj_perf_setmode(J, what, on)	(!(on))
+#define lj_perf_addtrace(J, T)		UNUSED(T)
+#define lj_perf_initstate(J)		UNUSED(J)
+#define lj_perf_freestate(J)		UNUSED(J)
+#endif
+
+#endif
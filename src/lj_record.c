@@ -230,7 +230,7 @@ static void canonicalize_slots(jit_State *J)
 }
 
 /* Stop recording. */
-static void rec_stop(jit_State *J, TraceLink linktype, TraceNo lnk)
+void lj_record_stop(jit_State *J, TraceLink linktype, TraceNo lnk)
 {
   lj_trace_end(J);
   J->cur.linktype = (uint8_t)linktype;
@@ -267,14 +267,25 @@ static TRef find_kinit(jit_State *J, const BCIns *endpc, BCReg slot, IRType t)
       return 0;  /* Multiple results, e.g. from a CALL or KNIL. */
     } else if (bcmode_a(op) == BCMdst && bc_a(ins) == slot) {
       if (op == BC_KSHORT || op == BC_KNUM) {  /* Found const. initializer. */
-	/* Now try to verify there's no forward jump across it. */
+	/* Now try to verify there's no forward jump across it. Only the
+	** expressions in the FORI header can jump there. All of their stores
+	** go to the loop base or above. So a store to a lower slot precedes
+	** the header and ends the search. Avoids scanning huge functions.
+	*/
 	const BCIns *kpc = pc;
-	for (; pc > startpc; pc--)
-	  if (bc_op(*pc) == BC_JMP) {
-	    const BCIns *target = pc+bc_j(*pc)+1;
+	BCReg base = bc_a(*endpc);
+	for (; pc > startpc; pc--) {
+	  BCIns jins = *pc;
+	  BCOp jop = bc_op(jins);
+	  if (jop == BC_JMP) {
+	    const BCIns *target = pc+bc_j(jins)+1;
 	    if (target > kpc && target <= endpc)
 	      return 0;  /* Conditional assignment. */
+	  } else if ((bcmode_a(jop) == BCMdst || bcmode_a(jop) == BCMbase) &&
+		     bc_a(jins) < base) {
+	    break;
 	  }
+	}
 	if (op == BC_KSHORT) {
 	  int32_t k = (int32_t)(int16_t)bc_d(ins);
 	  return t == IRT_INT ? lj_ir_kint(J, k) : lj_ir_knum(J, (lua_Number)k);
@@ -499,8 +510,7 @@ static LoopEvent rec_for(jit_State *J, const BCIns *fori, int isforl)
 static LoopEvent rec_iterl(jit_State *J, const BCIns iterins)
 {
   BCReg ra = bc_a(iterins);
-  lua_assert(J->base[ra] != 0);
-  if (!tref_isnil(J->base[ra])) {  /* Looping back? */
+  if (!tref_isnil(getslot(J, ra))) {  /* Looping back? */
     J->base[ra-1] = J->base[ra];  /* Copy result of ITERC to control var. */
     J->maxslot = ra-1+bc_b(J->pc[-1]);
     J->pc += bc_j(iterins)+1;
@@ -538,12 +548,12 @@ static int innerloopleft(jit_State *J, const BCIns *pc)
 /* Handle the case when an interpreted loop op is hit. */
 static void rec_loop_interp(jit_State *J, const BCIns *pc, LoopEvent ev)
 {
-  if (J->parent == 0) {
+  if (J->parent == 0 && J->exitno == 0) {
     if (pc == J->startpc && J->framedepth + J->retdepth == 0) {
       /* Same loop? */
       if (ev == LOOPEV_LEAVE)  /* Must loop back to form a root trace. */
 	lj_trace_err(J, LJ_TRERR_LLEAVE);
-      rec_stop(J, LJ_TRLINK_LOOP, J->cur.traceno);  /* Looping root trace. */
+      lj_record_stop(J, LJ_TRLINK_LOOP, J->cur.traceno);  /* Looping trace. */
     } else if (ev != LOOPEV_LEAVE) {  /* Entering inner loop? */
       /* It's usually better to abort here and wait until the inner loop
       ** is traced. But if the inner loop repeatedly didn't loop back,
@@ -568,15 +578,15 @@ static void rec_loop_interp(jit_State *J, const BCIns *pc, LoopEvent ev)
 /* Handle the case when an already compiled loop op is hit. */
 static void rec_loop_jit(jit_State *J, TraceNo lnk, LoopEvent ev)
 {
-  if (J->parent == 0) {  /* Root trace hit an inner loop. */
+  if (J->parent == 0 && J->exitno == 0) {  /* Root trace hit an inner loop. */
     /* Better let the inner loop spawn a side trace back here. */
     lj_trace_err(J, LJ_TRERR_LINNER);
   } else if (ev != LOOPEV_LEAVE) {  /* Side trace enters a compiled loop. */
     J->instunroll = 0;  /* Cannot continue across a compiled loop op. */
     if (J->pc == J->startpc && J->framedepth + J->retdepth == 0)
-      rec_stop(J, LJ_TRLINK_LOOP, J->cur.traceno);  /* Form an extra loop. */
+      lj_record_stop(J, LJ_TRLINK_LOOP, J->cur.traceno);  /* Extra loop. */
     else
-      rec_stop(J, LJ_TRLINK_ROOT, lnk);  /* Link to the loop. */
+      lj_record_stop(J, LJ_TRLINK_ROOT, lnk);  /* Link to the loop. */
   }  /* Side trace continues across a loop that's left or not entered. */
 }
 
@@ -595,6 +605,12 @@ static TRef rec_call_specialize(jit_State *J, GCfunc *fn, TRef tr)
       (void)lj_ir_kgc(J, obj2gco(pt), IRT_PROTO);  /* Prevent GC of proto. */
       return tr;
     }
+  } else if (fn->c.ffid == FF_coroutine_wrap_aux ||
+	     fn->c.ffid == FF_string_gmatch_aux) {
+    /* Each wrap()/gmatch() creates a new closure. Specialize to the ffid. */
+    TRef trid = emitir(IRT(IR_FLOAD, IRT_U8), tr, IRFL_FUNC_FFID);
+    emitir(IRTG(IR_EQ, IRT_INT), trid, lj_ir_kint(J, fn->c.ffid));
+    return tr;
   }
   /* Otherwise specialize to the function (closure) value itself. */
   kfunc = lj_ir_kfunc(J, fn);
@@ -635,9 +651,41 @@ void lj_record_call(jit_State *J, BCReg func, ptrdiff_t nargs)
   J->baseslot += func+1;
 }
 
+/* Lower the trace base below the vararg frame of the current function.
+** The vararg frame is then part of the trace and can be popped as usual.
+*/
+static void rec_varg_lower(jit_State *J, cTValue *frame, BCReg top)
+{
+  BCReg cbase = (BCReg)frame_delta(frame);
+  TRef fn;
+  lua_assert(frame_isvarg(frame) && J->framedepth == 0 && J->baseslot == 1);
+  if (!J->pt)
+    lj_trace_err(J, LJ_TRERR_NYIRETL);
+  if (J->baseslot + cbase + top >= LJ_MAX_JSLOTS)
+    lj_trace_err(J, LJ_TRERR_STACKOV);
+  if (top > J->maxslot) J->maxslot = top;
+  fn = getcurrf(J);
+  lj_snap_add(J);
+  /* Guard for the vararg frame link. This adjusts BASE by its delta. */
+  emitir(IRTG(IR_RETF, IRT_P32), lj_ir_kgc(J, obj2gco(J->pt), IRT_PROTO),
+	 lj_ir_kptr(J, (void *)(intptr_t)frame_ftsz(frame)));
+  J->retdepth++;
+  /* Shift all slots up and clear the slots of the lower frame. */
+  memmove(J->slot + cbase, J->slot, sizeof(TRef)*(J->baseslot + J->maxslot));
+  memset(J->slot, 0, sizeof(TRef)*cbase);
+  J->slot[cbase] = TREF_FRAME | fn;
+  J->baseslot += cbase;
+  J->base += cbase;
+  J->framedepth++;
+  J->needsnap = 1;
+  lj_snap_add(J);
+}
+
 /* Record tail call. */
 void lj_record_tailcall(jit_State *J, BCReg func, ptrdiff_t nargs)
 {
+  if (frame_isvarg(J->L->base - 1) && J->framedepth == 0)
+    rec_varg_lower(J, J->L->base - 1, func+1+(BCReg)nargs);
   rec_call_setup(J, func, nargs);
   if (frame_isvarg(J->L->base - 1)) {
     BCReg cbase = (BCReg)frame_delta(J->L->base - 1);
@@ -685,10 +733,10 @@ void lj_record_ret(jit_State *J, BCReg rbase, ptrdiff_t gotresults)
   ptrdiff_t i;
   for (i = 0; i < gotresults; i++)
     (void)getslot(J, rbase+i);  /* Ensure all results have a reference. */
-  while (frame_ispcall(frame)) {  /* Immediately resolve pcall() returns. */
+  /* Immediately resolve pcall() returns. Or return via interpreter below. */
+  while (frame_ispcall(frame) && J->framedepth > 0) {
     BCReg cbase = (BCReg)frame_delta(frame);
-    if (--J->framedepth < 0)
-      lj_trace_err(J, LJ_TRERR_NYIRETL);
+    J->framedepth--;
     lua_assert(J->baseslot > 1);
     gotresults++;
     rbase += cbase;
@@ -699,19 +747,22 @@ void lj_record_ret(jit_State *J, BCReg rbase, ptrdiff_t gotresults)
   }
   /* Return to lower frame via interpreter for unhandled cases. */
   if (J->framedepth == 0 && J->pt && bc_isret(bc_op(*J->pc)) &&
-       (!frame_islua(frame) ||
-	(J->parent == 0 && !bc_isret(bc_op(J->cur.startins))))) {
+       (!(frame_islua(frame) ||
+	  (frame_isvarg(frame) && frame_islua(frame_prevd(frame)))) ||
+	(J->parent == 0 && J->exitno == 0 &&
+	 !bc_isret(bc_op(J->cur.startins))))) {
     /* NYI: specialize to frame type and return directly, not via RET*. */
     for (i = 0; i < (ptrdiff_t)rbase; i++)
       J->base[i] = 0;  /* Purge dead slots. */
     J->maxslot = rbase + (BCReg)gotresults;
-    rec_stop(J, LJ_TRLINK_RETURN, 0);  /* Return to interpreter. */
+    lj_record_stop(J, LJ_TRLINK_RETURN, 0);  /* Return to interpreter. */
     return;
   }
   if (frame_isvarg(frame)) {
     BCReg cbase = (BCReg)frame_delta(frame);
-    if (--J->framedepth < 0)  /* NYI: return of vararg func to lower frame. */
-      lj_trace_err(J, LJ_TRERR_NYIRETL);
+    if (J->framedepth == 0)  /* Return of vararg func to lower frame. */
+      rec_varg_lower(J, frame, rbase + (BCReg)gotresults);
+    J->framedepth--;
     lua_assert(J->baseslot > 1);
     rbase += cbase;
     J->baseslot -= (BCReg)cbase;
@@ -729,7 +780,7 @@ void lj_record_ret(jit_State *J, BCReg rbase, ptrdiff_t gotresults)
       if (check_downrec_unroll(J, pt)) {
 	J->maxslot = (BCReg)(rbase + gotresults);
 	lj_snap_purge(J);
-	rec_stop(J, LJ_TRLINK_DOWNREC, J->cur.traceno);  /* Down-recursion. */
+	lj_record_stop(J, LJ_TRLINK_DOWNREC, J->cur.traceno);  /* Down-rec. */
 	return;
       }
       lj_snap_add(J);
@@ -742,7 +793,8 @@ void lj_record_ret(jit_State *J, BCReg rbase, ptrdiff_t gotresults)
       lua_assert(J->baseslot > cbase+1);
       J->baseslot -= cbase+1;
       J->base -= cbase+1;
-    } else if (J->parent == 0 && !bc_isret(bc_op(J->cur.startins))) {
+    } else if (J->parent == 0 && J->exitno == 0 &&
+	       !bc_isret(bc_op(J->cur.startins))) {
       /* Return to lower frame would leave the loop in a root trace. */
       lj_trace_err(J, LJ_TRERR_LLEAVE);
     } else {  /* Return to lower frame. Guard for the target we return to. */
@@ -1070,6 +1122,16 @@ static void rec_idx_abc(jit_State *J, TRef asizeref, TRef ikey, uint32_t asize)
 	  emitir(IRTG(IR_ABC, IRT_P32), asizeref, ikey);
 	return;
       }
+    } else {
+      TRef tr[2];
+      int32_t k[2];
+      /* Affine function of the index? Check both ends of the loop range. */
+      if (lj_opt_narrow_range(J, tref_ref(ikey), tr, k) &&
+	  (uint32_t)k[0] < asize && (uint32_t)k[1] < asize) {
+	emitir(IRTGI(IR_ABC), asizeref, tr[0]);
+	emitir(IRTGI(IR_ABC), asizeref, tr[1]);
+	return;
+      }
     }
   }
   emitir(IRTGI(IR_ABC), asizeref, ikey);  /* Emit regular bounds check. */
@@ -1399,9 +1461,9 @@ static void check_call_unroll(jit_State *J, TraceNo lnk)
     if (count + J->tailcalled > J->param[JIT_P_recunroll]) {
       J->pc++;
       if (J->framedepth + J->retdepth == 0)
-	rec_stop(J, LJ_TRLINK_TAILREC, J->cur.traceno);  /* Tail-recursion. */
+	lj_record_stop(J, LJ_TRLINK_TAILREC, J->cur.traceno);  /* Tail-rec. */
       else
-	rec_stop(J, LJ_TRLINK_UPREC, J->cur.traceno);  /* Up-recursion. */
+	lj_record_stop(J, LJ_TRLINK_UPREC, J->cur.traceno);  /* Up-recursion. */
     }
   } else {
     if (count > J->param[JIT_P_callunroll]) {
@@ -1475,9 +1537,9 @@ static void rec_func_jit(jit_State *J, TraceNo lnk)
   }
   J->instunroll = 0;  /* Cannot continue across a compiled function. */
   if (J->pc == J->startpc && J->framedepth + J->retdepth == 0)
-    rec_stop(J, LJ_TRLINK_TAILREC, J->cur.traceno);  /* Extra tail-recursion. */
+    lj_record_stop(J, LJ_TRLINK_TAILREC, J->cur.traceno);  /* Extra tail-rec. */
   else
-    rec_stop(J, LJ_TRLINK_ROOT, lnk);  /* Link to the function. */
+    lj_record_stop(J, LJ_TRLINK_ROOT, lnk);  /* Link to the function. */
 }
 
 /* -- Vararg handling ----------------------------------------------------- */
@@ -1583,6 +1645,10 @@ static void rec_varg(jit_State *J, BCReg dst, ptrdiff_t nresults)
       J->base[dst-2] = tr;
       J->maxslot = dst-1;
       J->bcskip = 2;  /* Skip CALLM + select. */
+    } else if (J->parent != 0 || J->exitno != 0) {
+      /* Make the vararg frame part of the side trace and try again. */
+      rec_varg_lower(J, J->L->base-1, dst);
+      rec_varg(J, dst, nresults);
     } else {
     nyivarg:
       setintV(&J->errinfo, BC_VARG);
@@ -2001,7 +2067,7 @@ void lj_record_ins(jit_State *J)
   case BC_JFORI:
     lua_assert(bc_op(pc[(ptrdiff_t)rc-BCBIAS_J]) == BC_JFORL);
     if (rec_for(J, pc, 0) != LOOPEV_LEAVE)  /* Link to existing loop. */
-      rec_stop(J, LJ_TRLINK_ROOT, bc_d(pc[(ptrdiff_t)rc-BCBIAS_J]));
+      lj_record_stop(J, LJ_TRLINK_ROOT, bc_d(pc[(ptrdiff_t)rc-BCBIAS_J]));
     /* Continue tracing if the loop is not entered. */
     break;
 
@@ -2137,6 +2203,12 @@ static const BCIns *rec_setup_root(jit_State *J)
     J->maxslot = J->pt->numparams;
     pc++;
     break;
+  case BC_CALL:
+  case BC_CALLM:
+  case BC_ITERC:
+    /* No bytecode range check for stitched traces. */
+    pc++;
+    break;
   default:
     lua_assert(0);
     break;
@@ -2205,7 +2277,7 @@ void lj_record_setup(jit_State *J)
     if (traceref(J, J->cur.root)->nchild >= J->param[JIT_P_maxside] ||
 	T->snap[J->exitno].count >= J->param[JIT_P_hotexit] +
 				    J->param[JIT_P_tryside]) {
-      rec_stop(J, LJ_TRLINK_INTERP, 0);
+      lj_record_stop(J, LJ_TRLINK_INTERP, 0);
     }
   } else {  /* Root trace. */
     J->cur.root = 0;
@@ -97,7 +97,8 @@ static BCReg snapshot_framelinks(jit_State *J, SnapEntry *map)
 {
   cTValue *frame = J->L->base - 1;
   cTValue *lim = J->L->base - J->baseslot;
-  cTValue *ftop = frame + funcproto(frame_func(frame))->framesize;
+  GCfunc *fn = frame_func(frame);
+  cTValue *ftop = isluafunc(fn) ? (frame+funcproto(fn)->framesize) : J->L->top;
   MSize f = 0;
   map[f++] = SNAP_MKPC(J->pc);  /* The current PC is always the first entry. */
   while (frame > lim) {  /* Backwards traversal of all frames above base. */
@@ -579,6 +580,122 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
     emitir_raw(IRTG(IR_GCSTEP, IRT_NIL), 0, 0);
 }
 
+/* -- Compiled snapshot restore ------------------------------------------- */
+
+/* Exits which are taken often, but not often enough to get a side trace,
+** pay for the generic restore on every exit. So the snapshot is compiled
+** to a compact restore program on its first exit. It has one instruction
+** per restored slot with the register, spill slot or constant to restore
+** from already resolved. The program is stored in T->snaprs at the same
+** offset as the snapshot map entries it's compiled from.
+**
+** The program can neither allocate nor throw, so it runs outside of the
+** protected call in lj_trace_exit(). Snapshots with sunk allocations need
+** the full lj_snap_restore().
+*/
+
+/* Restore instruction: slot | op << 8 | frame << 15 | arg << 16. */
+#define SNAPRS(slot, op, arg) \
+  ((SnapRestore)(slot) + ((SnapRestore)(op) << 8) + ((SnapRestore)(arg) << 16))
+#define SNAPRS_FRAME		0x8000	/* Overwrite tag with frame link. */
+#define snaprs_slot(r)		((r) & 0xff)
+#define snaprs_op(r)		(((r) >> 8) & 0x7f)
+#define snaprs_arg(r)		((r) >> 16)
+
+/* Restore instruction opcodes. */
+enum {
+  SNAPRS_NONE,		/* Not compiled, yet. */
+  SNAPRS_SLOW,		/* Needs the full restore. */
+  SNAPRS_END,		/* End of program. */
+  SNAPRS_KONST,		/* Constant. arg = IR ref. */
+  SNAPRS_RINT,		/* Integer in GPR. arg = GPR. */
+  SNAPRS_RNUM,		/* Number in FPR. arg = FPR. */
+  SNAPRS_RLUD,		/* 64 bit lightuserdata in GPR. arg = GPR. */
+  SNAPRS_RGC,		/* Other type in GPR. arg = GPR | irt << 8. */
+  SNAPRS_SINT,		/* Integer in spill slot. arg = spill slot. */
+  SNAPRS_S64,		/* Number or lightuserdata in spill slot. */
+  SNAPRS_SGC,		/* Other type in spill slot. arg = slot | irt << 8. */
+  SNAPRS_RINTN,		/* Integer in GPR converted to number. */
+  SNAPRS_SINTN		/* Integer in spill slot converted to number. */
+};
+
+/* Compile restore of a value. Returns 0 if not possible. */
+static SnapRestore snap_compileval(GCtrace *T, SnapNo snapno,
+				   BloomFilter rfilt, IRRef ref)
+{
+  IRIns *ir = &T->ir[ref];
+  IRType t = irt_type(ir->t);
+  RegSP rs = ir->prev;
+  if (irref_isk(ref))
+    return SNAPRS(0, SNAPRS_KONST, ref);
+  if (bloomtest(rfilt, ref))
+    rs = snap_renameref(T, snapno, ref, rs);
+  if (ra_hasspill(regsp_spill(rs))) {
+    uint32_t s = regsp_spill(rs);
+    if (irt_isinteger(ir->t))
+      return SNAPRS(0, SNAPRS_SINT, s);
+    else if ((!LJ_SOFTFP && irt_isnum(ir->t)) ||
+	     (LJ_64 && irt_islightud(ir->t)))
+      return SNAPRS(0, SNAPRS_S64, s);
+    else
+      return SNAPRS(0, SNAPRS_SGC, s + (t << 8));
+  } else {
+    Reg r = regsp_reg(rs);
+    if (ra_noreg(r)) {
+      SnapRestore sr;
+      lua_assert(ir->o == IR_CONV && ir->op2 == IRCONV_NUM_INT);
+      sr = snap_compileval(T, snapno, rfilt, ir->op1);
+      if (LJ_DUALNUM) {
+	if (snaprs_op(sr) == SNAPRS_RINT)
+	  sr += (SNAPRS_RINTN - SNAPRS_RINT) << 8;
+	else if (snaprs_op(sr) == SNAPRS_SINT)
+	  sr += (SNAPRS_SINTN - SNAPRS_SINT) << 8;
+	else
+	  return 0;
+      }
+      return sr;
+    } else if (irt_isinteger(ir->t)) {
+      return SNAPRS(0, SNAPRS_RINT, r-RID_MIN_GPR);
+#if !LJ_SOFTFP
+    } else if (irt_isnum(ir->t)) {
+      return SNAPRS(0, SNAPRS_RNUM, r-RID_MIN_FPR);
+#endif
+    } else if (LJ_64 && irt_islightud(ir->t)) {
+      return SNAPRS(0, SNAPRS_RLUD, r-RID_MIN_GPR);
+    } else {
+      return SNAPRS(0, SNAPRS_RGC, (r-RID_MIN_GPR) + (t << 8));
+    }
+  }
+}
+
+/* Compile restore program for a snapshot. */
+static void snap_compile(GCtrace *T, SnapNo snapno)
+{
+  SnapShot *snap = &T->snap[snapno];
+  MSize n, nent = snap->nent;
+  SnapEntry *map = &T->snapmap[snap->mapofs];
+  SnapRestore *rs = &T->snaprs[snap->mapofs], *rp = rs;
+  BloomFilter rfilt = snap_renamefilter(T, snapno);
+  for (n = 0; n < nent; n++) {
+    SnapEntry sn = map[n];
+    if (!(sn & SNAP_NORESTORE)) {
+      IRRef ref = snap_ref(sn);
+      SnapRestore sr;
+      if (T->ir[ref].r == RID_SUNK || (LJ_SOFTFP && (sn & SNAP_SOFTFPNUM)) ||
+	  !(sr = snap_compileval(T, snapno, rfilt, ref)))
+	goto slow;
+      sr += snap_slot(sn);
+      if ((sn & (SNAP_CONT|SNAP_FRAME)))
+	sr += SNAPRS_FRAME;
+      *rp++ = sr;
+    }
+  }
+  *rp = SNAPRS(0, SNAPRS_END, 0);  /* Fits, since map[nent] holds the PC. */
+  return;
+slow:
+  rs[0] = SNAPRS(0, SNAPRS_SLOW, 0);
+}
+
 /* -- Snapshot restore ---------------------------------------------------- */
 
 static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
@@ -785,6 +902,23 @@ static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
   }
 }
 
+/* Compute current stack top. */
+static void snap_restoretop(lua_State *L, SnapShot *snap, TValue *frame,
+			    const BCIns *pc)
+{
+  switch (bc_op(*pc)) {
+  default:
+    if (bc_op(*pc) < BC_FUNCF) {
+      L->top = curr_topL(L);
+      break;
+    }
+    /* fallthrough */
+  case BC_CALLM: case BC_CALLMT: case BC_RETM: case BC_TSETM:
+    L->top = frame + snap->nslots;
+    break;
+  }
+}
+
 /* Restore interpreter state from exit state with the help of a snapshot. */
 const BCIns *lj_snap_restore(jit_State *J, void *exptr)
 {
@@ -843,20 +977,82 @@ const BCIns *lj_snap_restore(jit_State *J, void *exptr)
     }
   }
   lua_assert(map + nent == flinks);
+  snap_restoretop(L, snap, frame, pc);
+  if (T->snaprs[snap->mapofs] == SNAPRS_NONE)
+    snap_compile(T, snapno);
+  return pc;
+}
 
-  /* Compute current stack top. */
-  switch (bc_op(*pc)) {
-  default:
-    if (bc_op(*pc) < BC_FUNCF) {
-      L->top = curr_topL(L);
+/* Restore interpreter state from an exit with a compiled snapshot.
+** Returns NULL if the full restore is needed.
+*/
+const BCIns *lj_snap_restore_fast(jit_State *J, void *exptr)
+{
+  ExitState *ex = (ExitState *)exptr;
+  GCtrace *T = traceref(J, J->parent);
+  SnapShot *snap = &T->snap[J->exitno];
+  SnapRestore *rs = &T->snaprs[snap->mapofs];
+  SnapEntry *flinks = &T->snapmap[snap_nextofs(T, snap)-1];
+  const BCIns *pc = snap_pc(T->snapmap[snap->mapofs + snap->nent]);
+  lua_State *L = J->L;
+  TValue *frame = L->base-1;
+  int32_t ftsz0 = frame_ftsz(frame);
+  if (snaprs_op(*rs) <= SNAPRS_SLOW ||
+      LJ_UNLIKELY(L->base + snap->topslot >= tvref(L->maxstack)))
+    return NULL;
+  for (;; rs++) {
+    SnapRestore sr = *rs;
+    TValue *o = &frame[snaprs_slot(sr)];
+    uint32_t arg = snaprs_arg(sr);
+    switch (snaprs_op(sr)) {
+    case SNAPRS_KONST:
+      lj_ir_kvalue(L, o, &T->ir[arg]);
+      break;
+    case SNAPRS_RINT:
+      setintV(o, (int32_t)ex->gpr[arg]);
+      break;
+#if !LJ_SOFTFP
+    case SNAPRS_RNUM:
+      setnumV(o, ex->fpr[arg]);
+      break;
+#endif
+    case SNAPRS_RLUD:
+      o->u64 = ex->gpr[arg];
+      break;
+    case SNAPRS_RGC:
+      if ((arg >> 8) > IRT_TRUE)  /* Not a primitive type. */
+	setgcrefi(o->gcr, ex->gpr[arg & 0xff]);
+      setitype(o, irt_toitype_(arg >> 8));
+      break;
+    case SNAPRS_SINT:
+      setintV(o, ex->spill[arg]);
+      break;
+    case SNAPRS_S64:
+      o->u64 = *(uint64_t *)&ex->spill[arg];
       break;
+    case SNAPRS_SGC:
+      setgcrefi(o->gcr, ex->spill[arg & 0xff]);
+      setitype(o, irt_toitype_(arg >> 8));
+      break;
+#if LJ_DUALNUM
+    case SNAPRS_RINTN:
+      setnumV(o, (lua_Number)(int32_t)ex->gpr[arg]);
+      break;
+    case SNAPRS_SINTN:
+      setnumV(o, (lua_Number)ex->spill[arg]);
+      break;
+#endif
+    default:
+      lua_assert(snaprs_op(sr) == SNAPRS_END);
+      lua_assert(T->snapmap + snap->mapofs + snap->nent == flinks);
+      snap_restoretop(L, snap, frame, pc);
+      return pc;
+    }
+    if ((sr & SNAPRS_FRAME)) {
+      o->fr.tp.ftsz = snaprs_slot(sr) != 0 ? (int32_t)*flinks-- : ftsz0;
+      L->base = o+1;
     }
-    /* fallthrough */
-  case BC_CALLM: case BC_CALLMT: case BC_RETM: case BC_TSETM:
-    L->top = frame + snap->nslots;
-    break;
   }
-  return pc;
 }
 
 #undef IR
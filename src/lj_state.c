@@ -34,6 +34,7 @@
 #define LJ_STACK_MAX	LUAI_MAXSTACK	/* Max. stack size. */
 #define LJ_STACK_START	(2*LJ_STACK_MIN)	/* Starting stack size. */
 #define LJ_STACK_MAXEX	(LJ_STACK_MAX + 1 + LJ_STACK_EXTRA)
+#define LJ_STACK_REUSE	(8*LJ_STACK_START)	/* Max. stack size for reuse. */
 
 /* Explanation of LJ_STACK_EXTRA:
 **
@@ -87,10 +88,17 @@ void lj_state_shrinkstack(lua_State *L, MSize used)
 {
   if (L->stacksize > LJ_STACK_MAXEX)
     return;  /* Avoid stack shrinking while handling stack overflow. */
-  if (4*used < L->stacksize &&
-      2*(LJ_STACK_START+LJ_STACK_EXTRA) < L->stacksize &&
-      obj2gco(L) != gcref(G(L)->jit_L))  /* Don't shrink stack of live trace. */
+  if (obj2gco(L) == gcref(G(L)->jit_L))
+    return;  /* Don't shrink stack of live trace. */
+  if (L->cframe == NULL && L != mainthread(G(L))) {
+    /* Suspended or dead coroutine: shrink to twice the used size at once. */
+    MSize n = 2*used < LJ_STACK_START ? LJ_STACK_START : 2*used;
+    if (2*(n+1+LJ_STACK_EXTRA) <= L->stacksize)
+      resizestack(L, n);
+  } else if (4*used < L->stacksize &&
+	     2*(LJ_STACK_START+LJ_STACK_EXTRA) < L->stacksize) {
     resizestack(L, L->stacksize >> 1);
+  }
 }
 
 /* Try to grow stack. */
@@ -117,13 +125,10 @@ void LJ_FASTCALL lj_state_growstack1(lua_State *L)
   lj_state_growstack(L, 1);
 }
 
-/* Allocate basic stack for new state. */
-static void stack_init(lua_State *L1, lua_State *L)
+/* Clear stack of new or recycled state. */
+static void stack_clear(lua_State *L1)
 {
-  TValue *stend, *st = lj_mem_newvec(L, LJ_STACK_START+LJ_STACK_EXTRA, TValue);
-  setmref(L1->stack, st);
-  L1->stacksize = LJ_STACK_START + LJ_STACK_EXTRA;
-  stend = st + L1->stacksize;
+  TValue *st = tvref(L1->stack), *stend = st + L1->stacksize;
   setmref(L1->maxstack, stend - LJ_STACK_EXTRA - 1);
   L1->base = L1->top = st+1;
   setthreadV(L1, st, L1);  /* Needed for curr_funcisL() on empty stack. */
@@ -131,6 +136,15 @@ static void stack_init(lua_State *L1, lua_State *L)
     setnilV(st++);
 }
 
+/* Allocate basic stack for new state. */
+static void stack_init(lua_State *L1, lua_State *L)
+{
+  TValue *st = lj_mem_newvec(L, LJ_STACK_START+LJ_STACK_EXTRA, TValue);
+  setmref(L1->stack, st);
+  L1->stacksize = LJ_STACK_START + LJ_STACK_EXTRA;
+  stack_clear(L1);
+}
+
 /* -- State handling ------------------------------------------------------ */
 
 /* Open parts that may cause memory-allocation errors. */
@@ -166,6 +180,7 @@ static void close_state(lua_State *L)
   lj_mem_freevec(g, g->strhash, g->strmask+1, GCRef);
   lj_str_freebuf(g, &g->tmpbuf);
   lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
+  lj_state_freepool(g);
   lua_assert(g->gc.total == sizeof(GG_State));
 #ifndef LUAJIT_USE_SYSMALLOC
   if (g->allocf == lj_alloc_f)
@@ -258,9 +273,27 @@ LUA_API void lua_close(lua_State *L)
   close_state(L);
 }
 
+/* Max. number of dead threads kept for reuse. */
+#define LJ_THREAD_POOL	64
+
 lua_State *lj_state_new(lua_State *L)
 {
-  lua_State *L1 = lj_mem_newobj(L, lua_State);
+  global_State *g = G(L);
+  lua_State *L1;
+  if (gcref(g->gc.freeth)) {  /* Reuse a dead thread and its stack. */
+    L1 = gco2th(gcref(g->gc.freeth));
+    setgcrefr(g->gc.freeth, L1->nextgc);
+    g->gc.nfreeth--;
+    setgcrefr(L1->nextgc, g->gc.root);
+    setgcref(g->gc.root, obj2gco(L1));
+    newwhite(g, L1);
+    L1->status = 0;
+    setgcrefr(L1->env, L->env);
+    stack_clear(L1);
+    lua_assert(iswhite(obj2gco(L1)) && L1->cframe == NULL);
+    return L1;
+  }
+  L1 = lj_mem_newobj(L, lua_State);
   L1->gct = ~LJ_TTHREAD;
   L1->dummy_ffid = FF_C;
   L1->status = 0;
@@ -276,11 +309,50 @@ lua_State *lj_state_new(lua_State *L)
   return L1;
 }
 
+/* Reset a suspended or dead thread to its initial state. */
+void lj_state_recycle(lua_State *L, lua_State *L1)
+{
+  lua_assert(L1->cframe == NULL && L1 != mainthread(G(L1)));
+  lj_func_closeuv(L1, tvref(L1->stack));
+  L1->status = 0;
+  if (L1->stacksize > LJ_STACK_REUSE+LJ_STACK_EXTRA) {
+    TValue *st = tvref(L1->stack);
+    MSize oldsize = L1->stacksize;
+    stack_init(L1, L);  /* Same size as a fresh stack. */
+    lj_mem_freevec(G(L), st, oldsize, TValue);
+  } else {
+    stack_clear(L1);
+  }
+}
+
 void LJ_FASTCALL lj_state_free(global_State *g, lua_State *L)
 {
   lua_assert(L != mainthread(g));
   lj_func_closeuv(L, tvref(L->stack));
   lua_assert(gcref(L->openupval) == NULL);
+  if (g->gc.nfreeth < LJ_THREAD_POOL &&
+      L->stacksize <= LJ_STACK_REUSE+LJ_STACK_EXTRA) {
+    /* Keep the thread and its stack around for the next lj_state_new. */
+    L->cframe = NULL;
+    setgcrefr(L->nextgc, g->gc.freeth);
+    setgcref(g->gc.freeth, obj2gco(L));
+    g->gc.nfreeth++;
+    return;
+  }
   lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
   lj_mem_freet(g, L);
 }
+
+/* Free all dead threads kept for reuse. */
+void lj_state_freepool(global_State *g)
+{
+  GCobj *o = gcref(g->gc.freeth);
+  while (o) {
+    lua_State *L = gco2th(o);
+    o = gcref(L->nextgc);
+    lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
+    lj_mem_freet(g, L);
+  }
+  setgcrefnull(g->gc.freeth);
+  g->gc.nfreeth = 0;
+}
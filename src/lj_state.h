@@ -27,7 +27,9 @@ static LJ_AINLINE void lj_state_checkstack(lua_State *L, MSize need)
 }
 
 LJ_FUNC lua_State *lj_state_new(lua_State *L);
+LJ_FUNC void lj_state_recycle(lua_State *L, lua_State *L1);
 LJ_FUNC void LJ_FASTCALL lj_state_free(global_State *g, lua_State *L);
+LJ_FUNC void lj_state_freepool(global_State *g);
 #if LJ_64
 LJ_FUNC lua_State *lj_state_newstate(lua_Alloc f, void *ud);
 #endif
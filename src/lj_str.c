@@ -90,6 +90,9 @@ void lj_str_resize(lua_State *L, MSize newmask)
   g->strhash = newhash;
 }
 
+/* Strings up to this length are hashed completely. */
+#define LJ_STR_HASHALL	32
+
 /* Intern a string and return string object. */
 GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
 {
@@ -108,6 +111,16 @@ GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
     b = lj_getu32(str+(len>>1)-2);
     h ^= b; h -= lj_rol(b, 14);
     b += lj_getu32(str+(len>>2)-1);
+    if (len <= LJ_STR_HASHALL) {
+      /* Hash all bytes of short strings. Identifiers often differ only in
+      ** a few digits, which the sparse hash above misses.
+      */
+      MSize i;
+      for (i = 4; i+4 < len; i += 4) {
+	a ^= lj_getu32(str+i); a -= lj_rol(b, 7);
+	b ^= a; b -= lj_rol(a, 19);
+      }
+    }
   } else if (len > 0) {
     a = *(const uint8_t *)str;
     h ^= *(const uint8_t *)(str+len-1);
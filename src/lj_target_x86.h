@@ -285,6 +285,13 @@ typedef enum {
   XO_CVTSS2SD =	XO_f30f(5a),
   XO_CVTSD2SS =	XO_f20f(5a),
   XO_ADDSS =	XO_f30f(58),
+  XO_MOVUPD =	XO_660f(10),
+  XO_MOVUPDto =	XO_660f(11),
+  XO_UNPCKLPD =	XO_660f(14),
+  XO_ADDPD =	XO_660f(58),
+  XO_SUBPD =	XO_660f(5c),
+  XO_MULPD =	XO_660f(59),
+  XO_DIVPD =	XO_660f(5e),
   XO_MOVD =	XO_660f(6e),
   XO_MOVDto =	XO_660f(7e),
 
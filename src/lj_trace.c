@@ -24,6 +24,7 @@
 #include "lj_trace.h"
 #include "lj_snap.h"
 #include "lj_gdbjit.h"
+#include "lj_perf.h"
 #include "lj_record.h"
 #include "lj_asm.h"
 #include "lj_dispatch.h"
@@ -31,6 +32,8 @@
 #include "lj_vmevent.h"
 #include "lj_target.h"
 
+#include <time.h>
+
 /* -- Error handling ------------------------------------------------------ */
 
 /* Synchronous abort with error message. */
@@ -82,41 +85,6 @@ static TraceNo trace_findfree(jit_State *J)
   memcpy(p, J->cur.field, J->cur.szfield*sizeof(tp)); \
   p += J->cur.szfield*sizeof(tp);
 
-#ifdef LUAJIT_USE_PERFTOOLS
-/*
-** Create symbol table of JIT-compiled code. For use with Linux perf tools.
-** Example usage:
-**   perf record -f -e cycles luajit test.lua
-**   perf report -s symbol
-**   rm perf.data /tmp/perf-*.map
-*/
-#include <stdio.h>
-#include <unistd.h>
-
-static void perftools_addtrace(GCtrace *T)
-{
-  static FILE *fp;
-  GCproto *pt = &gcref(T->startpt)->pt;
-  const BCIns *startpc = mref(T->startpc, const BCIns);
-  const char *name = proto_chunknamestr(pt);
-  BCLine lineno;
-  if (name[0] == '@' || name[0] == '=')
-    name++;
-  else
-    name = "(string)";
-  lua_assert(startpc >= proto_bc(pt) && startpc < proto_bc(pt) + pt->sizebc);
-  lineno = lj_debug_line(pt, proto_bcpos(pt, startpc));
-  if (!fp) {
-    char fname[40];
-    sprintf(fname, "/tmp/perf-%d.map", getpid());
-    if (!(fp = fopen(fname, "w"))) return;
-    setlinebuf(fp);
-  }
-  fprintf(fp, "%lx %x TRACE_%d::%s:%u\n",
-	  (long)T->mcode, T->szmcode, T->traceno, name, lineno);
-}
-#endif
-
 /* Save current trace by copying and compacting it. */
 static void trace_save(jit_State *J)
 {
@@ -124,7 +92,7 @@ static void trace_save(jit_State *J)
   size_t szins = (J->cur.nins-J->cur.nk)*sizeof(IRIns);
   size_t sz = sztr + szins +
 	      J->cur.nsnap*sizeof(SnapShot) +
-	      J->cur.nsnapmap*sizeof(SnapEntry);
+	      J->cur.nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore));
   GCtrace *T = lj_mem_newt(J->L, (MSize)sz, GCtrace);
   char *p = (char *)T + sztr;
   memcpy(T, &J->cur, sizeof(GCtrace));
@@ -137,13 +105,13 @@ static void trace_save(jit_State *J)
   p += szins;
   TRACE_APPENDVEC(snap, nsnap, SnapShot)
   TRACE_APPENDVEC(snapmap, nsnapmap, SnapEntry)
+  T->snaprs = (SnapRestore *)p;  /* Compiled on demand by lj_snap_restore. */
+  memset(p, 0, J->cur.nsnapmap*sizeof(SnapRestore));
   J->cur.traceno = 0;
   setgcrefp(J->trace[T->traceno], T);
   lj_gc_barriertrace(J2G(J), T->traceno);
   lj_gdbjit_addtrace(J, T);
-#ifdef LUAJIT_USE_PERFTOOLS
-  perftools_addtrace(T);
-#endif
+  lj_perf_addtrace(J, T);
 }
 
 void LJ_FASTCALL lj_trace_free(global_State *g, GCtrace *T)
@@ -157,7 +125,8 @@ void LJ_FASTCALL lj_trace_free(global_State *g, GCtrace *T)
   }
   lj_mem_free(g, T,
     ((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
-    T->nsnap*sizeof(SnapShot) + T->nsnapmap*sizeof(SnapEntry));
+    T->nsnap*sizeof(SnapShot) +
+    T->nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore)));
 }
 
 /* Re-enable compiling a prototype by unpatching any modified bytecode. */
@@ -187,7 +156,8 @@ static void trace_unpatch(jit_State *J, GCtrace *T)
     return;  /* No need to unpatch branches in parent traces (yet). */
   switch (bc_op(*pc)) {
   case BC_JFORL:
-    lua_assert(traceref(J, bc_d(*pc)) == T);
+    if (bc_d(*pc) != T->traceno)
+      break;  /* Patched by another trace. */
     *pc = T->startins;
     pc += bc_j(T->startins);
     lua_assert(bc_op(*pc) == BC_JFORI);
@@ -196,30 +166,42 @@ static void trace_unpatch(jit_State *J, GCtrace *T)
   case BC_JITERL:
   case BC_JLOOP:
     lua_assert(op == BC_ITERL || op == BC_LOOP || bc_isret(op));
-    *pc = T->startins;
+    if (bc_d(*pc) == T->traceno)
+      *pc = T->startins;
     break;
   case BC_JMP:
     lua_assert(op == BC_ITERL);
     pc += bc_j(*pc)+2;
-    if (bc_op(*pc) == BC_JITERL) {
-      lua_assert(traceref(J, bc_d(*pc)) == T);
+    if (bc_op(*pc) == BC_JITERL && bc_d(*pc) == T->traceno)
       *pc = T->startins;
-    }
     break;
   case BC_JFUNCF:
     lua_assert(op == BC_FUNCF);
-    *pc = T->startins;
+    if (bc_d(*pc) == T->traceno)
+      *pc = T->startins;
     break;
   default:  /* Already unpatched. */
     break;
   }
 }
 
+/* Check whether a root trace is still in the chain of its prototype. */
+static int trace_rooted(jit_State *J, GCtrace *T)
+{
+  TraceNo tr = gcref(T->startpt)->pt.trace;
+  for (; tr; tr = traceref(J, tr)->nextroot)
+    if (tr == T->traceno)
+      return 1;
+  return 0;
+}
+
 /* Flush a root trace. */
 static void trace_flushroot(jit_State *J, GCtrace *T)
 {
   GCproto *pt = &gcref(T->startpt)->pt;
   lua_assert(T->root == 0 && pt != NULL);
+  if (!trace_rooted(J, T))
+    return;  /* Already flushed, e.g. by an unstable loop exit. */
   /* First unpatch any modified bytecode. */
   trace_unpatch(J, T);
   /* Unlink root trace from chain anchored in prototype. */
@@ -273,6 +255,7 @@ int lj_trace_flushall(lua_State *L)
   }
   J->cur.traceno = 0;
   J->freetrace = 0;
+  J->stats.flush++;
   /* Clear penalty cache. */
   memset(J->penalty, 0, sizeof(J->penalty));
   /* Free the whole machine code and invalidate all exit stub groups. */
@@ -284,6 +267,189 @@ int lj_trace_flushall(lua_State *L)
   return 0;
 }
 
+/* -- Trace eviction ------------------------------------------------------ */
+
+/* Root trace of a trace family. A family is evicted as a whole. */
+#define trace_family(T)	((T)->root ? (TraceNo)(T)->root : (TraceNo)(T)->traceno)
+
+/* Marks for trace families. */
+enum { EVICT_NO, EVICT_TRY, EVICT_YES, EVICT_SKIP };
+
+#define evict_marked(m)	((m) == EVICT_TRY || (m) == EVICT_YES)
+
+/* Get a compiled trace. Excludes the trace currently being compiled. */
+static GCtrace *trace_live(jit_State *J, TraceNo tr)
+{
+  GCtrace *T = (tr > 0 && tr < J->sizetrace) ? traceref(J, tr) : NULL;
+  return (T && T != &J->cur) ? T : NULL;
+}
+
+/* Check whether the current trace depends on the machine code of a family. */
+static int trace_protected(jit_State *J, TraceNo fam)
+{
+  GCtrace *T;
+  if (J->parent && (T = trace_live(J, J->parent)) && trace_family(T) == fam)
+    return 1;
+  if (J->cur.link && (T = trace_live(J, J->cur.link)) && trace_family(T) == fam)
+    return 1;
+  return 0;
+}
+
+/* Mark a family for eviction, together with all families which link to
+** its machine code. Fails if this would evict a protected family.
+*/
+static int trace_markfamily(jit_State *J, uint8_t *mark, TraceNo fam)
+{
+  TraceNo i;
+  int changed, ok = 1;
+  if (mark[fam] != EVICT_NO)
+    return mark[fam] == EVICT_YES;
+  if (trace_protected(J, fam))
+    return 0;
+  mark[fam] = EVICT_TRY;
+  do {
+    changed = 0;
+    for (i = 1; i < J->sizetrace; i++) {
+      GCtrace *T = trace_live(J, i), *T2;
+      TraceNo f;
+      if (!T || !T->link || T->linktype == LJ_TRLINK_STITCH)
+	continue;  /* Stitched traces are only linked by number. */
+      f = trace_family(T);
+      if (evict_marked(mark[f]) || !(T2 = trace_live(J, T->link)) ||
+	  !evict_marked(mark[trace_family(T2)]))
+	continue;
+      if (mark[f] == EVICT_SKIP || trace_protected(J, f)) {
+	ok = 0;
+	break;
+      }
+      mark[f] = EVICT_TRY;
+      changed = 1;
+    }
+  } while (changed && ok);
+  for (i = 1; i < J->sizetrace; i++)
+    if (mark[i] == EVICT_TRY)
+      mark[i] = ok ? EVICT_YES : EVICT_NO;
+  return ok;
+}
+
+/* Evict all marked families. Returns the number of evicted traces. */
+static MSize trace_evictmarked(jit_State *J, uint8_t *mark)
+{
+  TraceNo i;
+  MSize n = 0;
+  for (i = 1; i < J->sizetrace; i++) {
+    GCtrace *T = trace_live(J, i);
+    if (T && mark[trace_family(T)] == EVICT_YES) {
+      if (T->root == 0)
+	trace_flushroot(J, T);
+      lj_gdbjit_deltrace(J, T);
+      T->traceno = 0;
+      setgcrefnull(J->trace[i]);
+      if (i < J->freetrace)
+	J->freetrace = i;
+      n++;
+    }
+  }
+  for (i = 1; i < J->sizetrace; i++) {
+    GCtrace *T = trace_live(J, i);
+    if (T) {
+      if (T->linktype == LJ_TRLINK_STITCH && !trace_live(J, T->link))
+	T->link = 0;  /* Stitched trace is gone. */
+      T->hits >>= 1;  /* Let the usage counts decay. */
+    }
+  }
+  return n;
+}
+
+/* Out of trace numbers. Evict the coldest families to free some of them. */
+static int trace_evictcold(jit_State *J)
+{
+  MSize want = (J->sizetrace >> 3) + 1, n = 0;
+  uint8_t *mark;
+  if ((J2G(J)->hookmask & HOOK_GC))
+    return 0;
+  mark = lj_mem_newvec(J->L, J->sizetrace, uint8_t);
+  memset(mark, EVICT_NO, J->sizetrace);
+  while (n < want) {
+    TraceNo i, fam = 0;
+    uint32_t hits = ~(uint32_t)0;
+    for (i = 1; i < J->sizetrace; i++) {  /* Find the coldest family left. */
+      GCtrace *T = trace_live(J, i);
+      if (T && T->root == 0 && mark[i] == EVICT_NO && T->hits < hits) {
+	fam = i;
+	hits = T->hits;
+      }
+    }
+    if (!fam)
+      break;
+    if (!trace_markfamily(J, mark, fam)) {
+      mark[fam] = EVICT_SKIP;
+      continue;
+    }
+    for (n = 0, i = 1; i < J->sizetrace; i++) {
+      GCtrace *T = trace_live(J, i);
+      if (T && mark[trace_family(T)] == EVICT_YES) n++;
+    }
+  }
+  n = trace_evictmarked(J, mark);
+  lj_mem_freevec(J2G(J), mark, J->sizetrace, uint8_t);
+  if (n) lj_mcode_reclaim(J);
+  return n != 0;
+}
+
+/* Mark all families with machine code in an MCode area. Returns 0 if the
+** area cannot be freed. Otherwise returns 1 and the sum of their hits.
+*/
+static int trace_markarea(jit_State *J, uint8_t *mark, MCode *mc, size_t sz,
+			  uint64_t *hits)
+{
+  MCode *end = (MCode *)((char *)mc + sz);
+  TraceNo i;
+  for (i = 0; i < LJ_MAX_EXITSTUBGR; i++)
+    if (J->exitstubgroup[i] >= mc && J->exitstubgroup[i] < end)
+      return 0;  /* Exit stubs are shared by all traces. */
+  memset(mark, EVICT_NO, J->sizetrace);
+  *hits = 0;
+  for (i = 1; i < J->sizetrace; i++) {
+    GCtrace *T = trace_live(J, i);
+    if (T && T->mcode >= mc && T->mcode < end) {
+      TraceNo fam = trace_family(T);
+      if (mark[fam] == EVICT_NO)
+	*hits += traceref(J, fam)->hits;
+      if (!trace_markfamily(J, mark, fam))
+	return 0;
+    }
+  }
+  return 1;
+}
+
+/* Out of machine code memory. Evict all families in the coldest of the
+** older MCode areas and free it. Returns 0 if nothing could be freed.
+*/
+int lj_trace_evictmcode(jit_State *J)
+{
+  size_t oldsz = J->szallmcarea, sz, bestsz = 0;
+  MCode *mc, *best = NULL;
+  uint64_t hits, besthits = ~(uint64_t)0;
+  uint8_t *mark;
+  if ((J2G(J)->hookmask & HOOK_GC))
+    return 0;
+  mark = lj_mem_newvec(J->L, J->sizetrace, uint8_t);
+  for (mc = lj_mcode_nextarea(J, NULL, &sz); mc;
+       mc = lj_mcode_nextarea(J, mc, &sz))
+    if (trace_markarea(J, mark, mc, sz, &hits) && hits < besthits) {
+      best = mc;
+      bestsz = sz;
+      besthits = hits;
+    }
+  if (best && trace_markarea(J, mark, best, bestsz, &hits)) {
+    trace_evictmarked(J, mark);
+    lj_mcode_reclaim(J);
+  }
+  lj_mem_freevec(J2G(J), mark, J->sizetrace, uint8_t);
+  return J->szallmcarea < oldsz;
+}
+
 /* Initialize JIT compiler state. */
 void lj_trace_initstate(global_State *g)
 {
@@ -296,6 +462,7 @@ void lj_trace_initstate(global_State *g)
   tv = LJ_KSIMD(J, LJ_KSIMD_NEG);
   tv[0].u64 = U64x(80000000,00000000);
   tv[1].u64 = U64x(80000000,00000000);
+  lj_perf_initstate(J);
 }
 
 /* Free everything associated with the JIT compiler state. */
@@ -315,6 +482,7 @@ void lj_trace_freestate(global_State *g)
   lj_mem_freevec(g, J->snapbuf, J->sizesnap, SnapShot);
   lj_mem_freevec(g, J->irbuf + J->irbotlim, J->irtoplim - J->irbotlim, IRIns);
   lj_mem_freevec(g, J->trace, J->sizetrace, GCRef);
+  lj_perf_freestate(J);
 }
 
 /* -- Penalties and blacklisting ------------------------------------------ */
@@ -351,8 +519,35 @@ setpenalty:
   hotcount_set(J2GG(J), pc+1, val);
 }
 
+/* -- Trace stitching ---------------------------------------------------- */
+
+/* Get the PC following the call which ended a stitching trace. */
+static const BCIns *trace_stitchpc(GCtrace *T)
+{
+  SnapShot *snap = &T->snap[T->nsnap-1];
+  /* Innermost frame is the continuation frame: [pc|ftsz|contpc]. */
+  return snap_pc(T->snapmap[snap->mapofs + snap->nent + 2]);
+}
+
+/* Get the previous trace of a stitched trace, if it's still there. */
+static GCtrace *trace_stitchprev(jit_State *J)
+{
+  TraceNo prev = J->exitno;
+  GCtrace *T = prev < J->sizetrace ? traceref(J, prev) : NULL;
+  if (T && T->linktype == LJ_TRLINK_STITCH &&
+      trace_stitchpc(T) == mref(J->cur.startpc, BCIns)+1)
+    return T;
+  return NULL;
+}
+
 /* -- Trace compiler state machine ---------------------------------------- */
 
+/* CPU time in seconds, for the trace compiler statistics. */
+static double trace_cputime(void)
+{
+  return (double)clock() * (1.0/(double)CLOCKS_PER_SEC);
+}
+
 /* Start tracing. */
 static void trace_start(jit_State *J)
 {
@@ -360,7 +555,7 @@ static void trace_start(jit_State *J)
   TraceNo traceno;
 
   if ((J->pt->flags & PROTO_NOJIT)) {  /* JIT disabled for this proto? */
-    if (J->parent == 0) {
+    if (J->parent == 0 && J->exitno == 0) {
       /* Lazy bytecode patching to disable hotcount events. */
       lua_assert(bc_op(*J->pc) == BC_FORL || bc_op(*J->pc) == BC_ITERL ||
 		 bc_op(*J->pc) == BC_LOOP || bc_op(*J->pc) == BC_FUNCF);
@@ -375,9 +570,12 @@ static void trace_start(jit_State *J)
   traceno = trace_findfree(J);
   if (LJ_UNLIKELY(traceno == 0)) {  /* No free trace? */
     lua_assert((J2G(J)->hookmask & HOOK_GC) == 0);
-    lj_trace_flushall(J->L);
-    J->state = LJ_TRACE_IDLE;  /* Silently ignored. */
-    return;
+    /* Evict cold traces first and only flush everything as a last resort. */
+    if (!trace_evictcold(J) || (traceno = trace_findfree(J)) == 0) {
+      lj_trace_flushall(J->L);
+      J->state = LJ_TRACE_IDLE;  /* Silently ignored. */
+      return;
+    }
   }
   setgcrefp(J->trace[traceno], &J->cur);
 
@@ -395,6 +593,11 @@ static void trace_start(jit_State *J)
   J->postproc = LJ_POST_NONE;
   lj_resetsplit(J);
   setgcref(J->cur.startpt, obj2gco(J->pt));
+  if (J->parent)
+    J->stats.startside++;
+  else
+    J->stats.start++;
+  J->stats.cstart = trace_cputime();
 
   L = J->L;
   lj_vmevent_send(L, TRACE,
@@ -439,6 +642,15 @@ static void trace_stop(jit_State *J)
   case BC_RET1:
     *pc = BCINS_AD(BC_JLOOP, J->cur.snap[0].nslots, traceno);
     goto addroot;
+  case BC_CALL:
+  case BC_CALLM:
+  case BC_ITERC:
+    /* Link the previous trace to the stitched trace. */
+    {
+      GCtrace *T = trace_stitchprev(J);
+      if (T) T->link = (TraceNo1)traceno;
+    }
+    break;
   case BC_JMP:
     /* Patch exit branch in parent to side trace entry. */
     lua_assert(J->parent != 0 && J->cur.root != 0);
@@ -462,6 +674,9 @@ static void trace_stop(jit_State *J)
   lj_mcode_commit(J, J->cur.mcode);
   J->postproc = LJ_POST_NONE;
   trace_save(J);
+  J->stats.stop++;
+  J->stats.mcode += traceref(J, traceno)->szmcode;
+  J->stats.ctime += trace_cputime() - J->stats.cstart;
 
   L = J->L;
   lj_vmevent_send(L, TRACE,
@@ -485,6 +700,52 @@ static int trace_downrec(jit_State *J)
   return 1;
 }
 
+/* Find original Lua function call and PC where recording was aborted. */
+static GCfunc *trace_abortfunc(jit_State *J, const BCIns **pcp)
+{
+  TValue *frame = J->L->base-1;
+  const BCIns *pc = J->pc;
+  while (!isluafunc(frame_func(frame))) {
+    pc = (frame_iscont(frame) ? frame_contpc(frame) : frame_pc(frame)) - 1;
+    frame = frame_prev(frame);
+  }
+  *pcp = pc;
+  return frame_func(frame);
+}
+
+LJ_STATIC_ASSERT(LJ_TRERR__MAX <= STATERR_MAX);
+
+/* Add trace abort to statistics. */
+static void trace_statabort(jit_State *J, TraceError e)
+{
+  TraceStats *st = &J->stats;
+  TraceStatLoc *loc = &st->loc[0];
+  const BCIns *pc;
+  GCproto *pt = funcproto(trace_abortfunc(J, &pc));
+  MSize i;
+  st->abort++;
+  st->ctime += trace_cputime() - st->cstart;
+  if (e < STATERR_MAX)
+    st->reason[e]++;
+  for (i = 0; i < STATLOC_SLOTS; i++) {
+    if (mref(st->loc[i].pc, const BCIns) == pc) {
+      loc = &st->loc[i];
+      break;
+    }
+    if (st->loc[i].count < loc->count)
+      loc = &st->loc[i];
+  }
+  if (mref(loc->pc, const BCIns) != pc) {  /* Replace slot with least aborts. */
+    setmref(loc->pc, pc);
+    loc->count = 0;
+    loc->line = proto_bcpos(pt, pc) < pt->sizebc ?
+		lj_debug_line(pt, proto_bcpos(pt, pc)) : 0;
+    lj_debug_shortname(loc->name, proto_chunkname(pt));
+  }
+  loc->count++;
+  loc->reason = (uint16_t)e;
+}
+
 /* Abort tracing. */
 static int trace_abort(jit_State *J)
 {
@@ -502,8 +763,14 @@ static int trace_abort(jit_State *J)
     return 1;  /* Retry ASM with new MCode area. */
   }
   /* Penalize or blacklist starting bytecode instruction. */
-  if (J->parent == 0 && !bc_isret(bc_op(J->cur.startins)))
-    penalty_pc(J, &gcref(J->cur.startpt)->pt, mref(J->cur.startpc, BCIns), e);
+  if (J->parent == 0 && !bc_isret(bc_op(J->cur.startins))) {
+    if (J->exitno == 0) {
+      penalty_pc(J, &gcref(J->cur.startpt)->pt, mref(J->cur.startpc, BCIns), e);
+    } else {  /* Blacklist a stitched trace by self-linking the previous one. */
+      GCtrace *T = trace_stitchprev(J);
+      if (T) T->link = (TraceNo1)J->exitno;
+    }
+  }
 
   /* Is there anything to abort? */
   traceno = J->cur.traceno;
@@ -511,20 +778,12 @@ static int trace_abort(jit_State *J)
     ptrdiff_t errobj = savestack(L, L->top-1);  /* Stack may be resized. */
     J->cur.link = 0;
     J->cur.linktype = LJ_TRLINK_NONE;
+    trace_statabort(J, e);
     lj_vmevent_send(L, TRACE,
-      TValue *frame;
       const BCIns *pc;
-      GCfunc *fn;
+      GCfunc *fn = trace_abortfunc(J, &pc);
       setstrV(L, L->top++, lj_str_newlit(L, "abort"));
       setintV(L->top++, traceno);
-      /* Find original Lua function call to generate a better error message. */
-      frame = J->L->base-1;
-      pc = J->pc;
-      while (!isluafunc(frame_func(frame))) {
-	pc = (frame_iscont(frame) ? frame_contpc(frame) : frame_pc(frame)) - 1;
-	frame = frame_prev(frame);
-      }
-      fn = frame_func(frame);
       setfuncV(L, L->top++, fn);
       setintV(L->top++, proto_bcpos(funcproto(fn), pc));
       copyTV(L, L->top++, restorestack(L, errobj));
@@ -667,14 +926,108 @@ void LJ_FASTCALL lj_trace_hot(jit_State *J, const BCIns *pc)
   ERRNO_RESTORE
 }
 
+/* A stitched builtin returned. Enter or start recording the next trace.
+** Returns the trace to continue with or 0 to continue in the interpreter.
+*/
+TraceNo LJ_FASTCALL lj_trace_stitch(jit_State *J, TraceNo prev)
+{
+  lua_State *L = J->L;
+  /* Note: the interpreter PC is the instruction following the call. */
+  const BCIns *pc = cframe_pc(cframe_raw(L->cframe));
+  GCtrace *T = prev < J->sizetrace ? traceref(J, prev) : NULL;
+  TraceNo lnk = 0;
+  ERRNO_SAVE
+  if (T && T->linktype == LJ_TRLINK_STITCH && trace_stitchpc(T) == pc) {
+    lnk = T->link;
+    if (lnk == prev) {
+      lnk = 0;  /* Blacklisted. */
+    } else if (lnk) {
+      GCtrace *T2 = lnk < J->sizetrace ? traceref(J, lnk) : NULL;
+      if (!(T2 && mref(T2->startpc, BCIns) == pc-1))
+	lnk = T->link = 0;  /* Stale link. Retry on the next return. */
+    } else if (J->state == LJ_TRACE_IDLE && (J->flags & JIT_F_ON) &&
+	       !(J2G(J)->hookmask & (HOOK_GC|HOOK_VMEVENT))) {
+      J->parent = 0;  /* Root trace, but stitched to the previous trace. */
+      J->exitno = prev;
+      J->state = LJ_TRACE_START;
+      L->top = curr_topL(L);
+      lj_trace_ins(J, pc-1);
+    }
+  }
+  ERRNO_RESTORE
+  return lnk;
+}
+
+/* Count consecutive entries of a root trace ending at the same exit. */
+static void trace_exitstreak(jit_State *J, GCtrace *T)
+{
+  if (T->unstexit == J->exitno && T->hits - T->unsthits == 1) {
+    if (T->unstable < 255) T->unstable++;
+  } else {
+    T->unstexit = (uint16_t)J->exitno;
+    T->unstable = 0;
+  }
+  T->unsthits = T->hits;
+}
+
+/* Check whether a hot exit shows that a looping root trace is unstable.
+**
+** A root trace follows the path taken by the iteration it was recorded in.
+** If that path turns out to be rare, every entry from the interpreter
+** exits from the first iteration already and never gets to the loop. A
+** side trace for such an exit only links back to the start of the root
+** trace, so every iteration would run through the first iteration plus
+** the side trace. Better retrace the loop instead, which then follows the
+** dominant path.
+**
+** This is detected from a streak of entries ending at the same exit.
+** Entries are only counted by some VMs.
+*/
+static int trace_unstable(GCtrace *T, SnapShot *snap)
+{
+  const BCIns *startpc, *pc;
+  IRRef ref;
+  if (T->root != 0 || T->linktype != LJ_TRLINK_LOOP || T->hits == 0 ||
+      2*(T->unstable+1) < snap->count)
+    return 0;
+  startpc = mref(T->startpc, const BCIns);
+  if (!((bc_op(*startpc) == BC_JLOOP || bc_op(*startpc) == BC_JFORL ||
+	 bc_op(*startpc) == BC_JITERL) && bc_d(*startpc) == T->traceno))
+    return 0;  /* Not the installed root trace anymore. */
+  /* Only consider exits to the loop body. Others just leave the loop. */
+  pc = snap_pc(T->snapmap[snap->mapofs + snap->nent]);
+  if (bc_op(T->startins) == BC_LOOP ?
+      !(pc > startpc && pc <= startpc + bc_j(T->startins)) :
+      !(pc > startpc + bc_j(T->startins) && pc < startpc))
+    return 0;
+  for (ref = REF_FIRST; ref < T->nins; ref++)
+    if (T->ir[ref].o == IR_LOOP)
+      return snap->ref < ref;  /* Exit from the first iteration? */
+  return 0;
+}
+
 /* Check for a hot side exit. If yes, start recording a side trace. */
 static void trace_hotside(jit_State *J, const BCIns *pc)
 {
-  SnapShot *snap = &traceref(J, J->parent)->snap[J->exitno];
+  GCtrace *T = traceref(J, J->parent);
+  SnapShot *snap = &T->snap[J->exitno];
+  if (T->root == 0)
+    trace_exitstreak(J, T);
   if (!(J2G(J)->hookmask & (HOOK_GC|HOOK_VMEVENT)) &&
       snap->count != SNAPCOUNT_DONE &&
       ++snap->count >= J->param[JIT_P_hotexit]) {
     lua_assert(J->state == LJ_TRACE_IDLE);
+    if (trace_unstable(T, snap)) {
+      /* Unpatch the loop and let it get hot again. Repeated failures
+      ** end up blacklisting it. The flushed root stays alive for traces
+      ** linked to it, but it's unlinked from the prototype, so later
+      ** flushes skip it.
+      */
+      trace_flushroot(J, T);
+      penalty_pc(J, &gcref(T->startpt)->pt, mref(T->startpc, BCIns),
+		 LJ_TRERR_LUNSTAB);
+      return;
+    }
     /* J->parent is non-zero for a side trace. */
     J->state = LJ_TRACE_START;
     lj_trace_ins(J, pc);
@@ -761,11 +1114,16 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
   }
 #endif
   lua_assert(T != NULL && J->exitno < T->nsnap);
-  exd.J = J;
-  exd.exptr = exptr;
-  errcode = lj_vm_cpcall(L, NULL, &exd, trace_exit_cp);
-  if (errcode)
-    return -errcode;  /* Return negated error code. */
+  J->stats.exits++;
+  if (T->exits != ~(uint32_t)0) T->exits++;
+  exd.pc = lj_snap_restore_fast(J, exptr);
+  if (!exd.pc) {  /* Need the full restore, which may throw. */
+    exd.J = J;
+    exd.exptr = exptr;
+    errcode = lj_vm_cpcall(L, NULL, &exd, trace_exit_cp);
+    if (errcode)
+      return -errcode;  /* Return negated error code. */
+  }
 
   lj_vmevent_send(L, TEXIT,
     lj_state_checkstack(L, 4+RID_NUM_GPR+RID_NUM_FPR+LUA_MINSTACK);
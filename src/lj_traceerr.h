@@ -17,6 +17,7 @@ TREDEF(NYIBC,	"NYI: bytecode %d")
 TREDEF(LLEAVE,	"leaving loop in root trace")
 TREDEF(LINNER,	"inner loop in root trace")
 TREDEF(LUNROLL,	"loop unroll limit reached")
+TREDEF(LUNSTAB,	"unstable loop entry")
 
 /* Recording calls/returns. */
 TREDEF(BADTYPE,	"bad argument type")
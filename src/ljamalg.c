@@ -50,6 +50,7 @@
 #include "lj_bcread.c"
 #include "lj_bcwrite.c"
 #include "lj_load.c"
+#include "lj_image.c"
 #include "lj_ctype.c"
 #include "lj_cdata.c"
 #include "lj_cconv.c"
@@ -75,6 +76,7 @@
 #include "lj_asm.c"
 #include "lj_trace.c"
 #include "lj_gdbjit.c"
+#include "lj_perf.c"
 #include "lj_alloc.c"
 
 #include "lib_aux.c"
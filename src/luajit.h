@@ -49,8 +49,12 @@ enum {
 
   LUAJIT_MODE_TRACE,		/* Flush a compiled trace. */
 
+  LUAJIT_MODE_PERF,		/* Output for Linux perf tools (idx = flags). */
+
   LUAJIT_MODE_WRAPCFUNC = 0x10,	/* Set wrapper mode for C function calls. */
 
+  LUAJIT_MODE_LAZYLOAD,		/* Load bytecode prototypes on demand. */
+
   LUAJIT_MODE_MAX
 };
 
@@ -59,11 +63,38 @@ enum {
 #define LUAJIT_MODE_ON		0x0100	/* Turn feature on. */
 #define LUAJIT_MODE_FLUSH	0x0200	/* Flush JIT-compiled code. */
 
+/* Flags for LUAJIT_MODE_PERF passed in idx. */
+#define LUAJIT_PERF_MAP		0x0001	/* Symbol table /tmp/perf-<pid>.map. */
+#define LUAJIT_PERF_JITDUMP	0x0002	/* Trace records in jit-<pid>.dump. */
+
 /* LuaJIT public C API. */
 
 /* Control the JIT engine. */
 LUA_API int luaJIT_setmode(lua_State *L, int idx, int mode);
 
+/* Raw stack frame, see luaJIT_getframes(). */
+typedef struct luaJIT_Frame {
+  const void *func;	/* Lua function prototype or C function pointer. */
+  int pc;		/* Bytecode position or -1 for C functions. */
+} luaJIT_Frame;
+
+/* Capture up to n stack frames. Fast, doesn't allocate. */
+LUA_API int luaJIT_getframes(lua_State *L, int level, luaJIT_Frame *fr, int n);
+
+/* Fill source and line fields for a captured Lua frame. */
+LUA_API int luaJIT_getframeinfo(const luaJIT_Frame *fr, lua_Debug *ar);
+
+/* Push table with trace compiler statistics. Optionally reset them. */
+LUA_API int luaJIT_getstats(lua_State *L, int reset);
+
+/* Load a chunk, referencing the buffer (e.g. an mmap'ed file) in place. */
+LUA_API int luaJIT_loadmapped(lua_State *L, const char *buf, size_t size,
+			      const char *name);
+
+/* Snapshot the state to a heap image and restore it into a fresh state. */
+LUA_API int luaJIT_saveimage(lua_State *L, lua_Writer writer, void *data);
+LUA_API int luaJIT_loadimage(lua_State *L, const char *buf, size_t size);
+
 /* Enforce (dynamic) linker error for version mismatches. Call from main. */
 LUA_API void LUAJIT_VERSION_SYM(void);
 
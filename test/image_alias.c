@@ -0,0 +1,81 @@
+/*
+** Heap images must resolve C functions and userdata saved under aliases.
+** Build: cc -Isrc -o image_alias test/image_alias.c src/libluajit.a -lm -ldl
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "luajit.h"
+
+typedef struct Buf {
+  char *p;
+  size_t n;
+} Buf;
+
+static int writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+  Buf *b = (Buf *)ud;
+  (void)L;
+  b->p = (char *)realloc(b->p, b->n + sz);
+  memcpy(b->p + b->n, p, sz);
+  b->n += sz;
+  return 0;
+}
+
+static int hostfn(lua_State *L)
+{
+  lua_pushliteral(L, "host");
+  return 1;
+}
+
+static const luaL_Reg hostlib[] = {
+  { "fn", hostfn },
+  { NULL, NULL }
+};
+
+static lua_State *newstate(void)
+{
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  luaL_register(L, "host", hostlib);
+  lua_pop(L, 1);
+  return L;
+}
+
+static void run(lua_State *L, const char *s)
+{
+  if (luaL_dostring(L, s)) {
+    fprintf(stderr, "FAIL: %s\n", lua_tostring(L, -1));
+    exit(1);
+  }
+}
+
+int main(void)
+{
+  lua_State *L = newstate();
+  Buf b = { NULL, 0 };
+  /* Aliases in the globals are found before the library paths. */
+  run(L, "out, hf = io.stdout, host.fn\n"
+	 "t = { out = out, hf = hf }\n");
+  if (luaJIT_saveimage(L, writer, &b)) {
+    fprintf(stderr, "FAIL: save: %s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  lua_close(L);
+  L = newstate();
+  if (luaJIT_loadimage(L, b.p, b.n)) {
+    fprintf(stderr, "FAIL: load: %s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  run(L, "assert(out == io.stdout and t.out == io.stdout)\n"
+	 "assert(hf == host.fn and t.hf() == 'host')\n");
+  lua_close(L);
+  free(b.p);
+  printf("OK\n");
+  return 0;
+}
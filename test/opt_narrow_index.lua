@@ -0,0 +1,44 @@
+-- Scaled array indexes in loops. Run with: luajit opt_narrow_index.lua
+
+local t = {}
+for i=1,1000 do t[i] = i end
+
+do  -- Scaled index inside the array part.
+  local s = 0
+  for i=1,300 do s = s + t[3*i-2] end
+  assert(s == 134850)
+end
+
+do  -- Scaled index beyond the array part at the end of the loop.
+  local n = 0
+  for i=1,400 do if t[3*i] == nil then n = n + 1 end end
+  assert(n == 67)
+end
+
+do  -- Negative scale, counting down from the end.
+  local s = 0
+  for i=1,200 do s = s + t[1001-5*i] end
+  assert(s == 99700)
+end
+
+do  -- Invariant stop value and offset.
+  local s, m, o = 0, 250, 7
+  for i=1,m do s = s + t[2*i+o] + t[4*i-3] end
+  assert(s == 189250)
+end
+
+do  -- Overflow of the index must not wrap around.
+  local n = 0
+  for i=1,100 do
+    local k = i < 90 and 1 or 0x7fffffff
+    if t[k*3] then n = n + 1 end
+  end
+  assert(n == 89)
+end
+
+do  -- Outside of a loop range.
+  local s = 0
+  local i = 1
+  while i <= 300 do s = s + t[3*i-2]; i = i + 1 end
+  assert(s == 134850)
+end
@@ -0,0 +1,25 @@
+-- Length of tables allocated in a trace. Run with: luajit opt_tablen.lua
+
+do  -- Constant length of a new table.
+  local out = {}
+  for i=1,100 do local t = {i, i+1, i+2}; out[i] = #t end
+  for i=1,100 do assert(out[i] == 3) end
+end
+
+do  -- Hole in the array part.
+  local out = {}
+  for i=1,100 do local b = nil; local t = {i, b, i+2}; out[i] = #t end
+  for i=1,100 do assert(out[i] == 1 or out[i] == 3) end
+end
+
+do  -- A new string key rehashes the table and shrinks the array part.
+  local out = {}
+  for i=1,100 do local b = nil; local t = {i, b, i+2}; t.x = 1; out[i] = #t end
+  for i=1,100 do assert(out[i] == 1) end
+end
+
+do  -- Ditto for a numeric key.
+  local out = {}
+  for i=1,100 do local t = {i, i+1}; t[4] = i; out[i] = #t end
+  for i=1,100 do assert(out[i] == 2 or out[i] == 4) end
+end